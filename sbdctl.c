@@ -28,8 +28,525 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include "sbdctl.h"
 
+// Trace record/replay
+//  Record mode (-R) logs every chunk that crosses the serial port, timestamped,
+//  at the write_to_imu()/read_raw_imu() boundary.  Replay mode (-P) feeds the
+//  recorded RX chunks back to the parser in the same order and swallows TX,
+//  so parsing changes can be checked against field traffic without a modem
+//  and without waiting on the link.
+//
+//  Trace file format, multi-byte fields big-endian like the modem's own:
+//   header:  "SBDT" <1 byte version> <8 bytes start time, usec since 1970>
+//   record:  <4 bytes usec since previous record> <1 byte TRACE_TX/TRACE_RX>
+//            <2 bytes len> <len bytes data>
+static int trace_fd = -1;
+static int replay_fd = -1;
+static uint64_t trace_last_us;
+
+// replay state.  One record is held at a time and handed out in pieces
+//  if the parser asks for less than was recorded.
+static unsigned char replay_chunk[0x10000];
+static int replay_dir = -1;
+static int replay_len, replay_pos;
+static unsigned int replay_records, replay_rx_bytes, replay_tx_mismatch;
+static uint64_t replay_trace_us, replay_start_us;
+
+static uint64_t now_us(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// open filename for recording and write the trace header.
+// returns 0, or -1 with errno set.
+int trace_record_open(char* filename){
+	unsigned char hdr[13];
+	int i;
+	trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(trace_fd == -1) return -1;
+	trace_last_us = now_us();
+	memcpy(hdr, TRACE_MAGIC, 4);
+	hdr[4] = TRACE_VERSION;
+	for(i = 0; i < 8; i++)
+		hdr[5+i] = trace_last_us >> (56 - 8*i);
+	if(write(trace_fd, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+	return 0;
+}
+
+// open filename for replay and check the trace header.
+// returns 0, or -1 if the file can't be read or isn't a trace.
+int trace_replay_open(char* filename){
+	unsigned char hdr[13];
+	replay_fd = open(filename, O_RDONLY);
+	if(replay_fd == -1) return -1;
+	if((read(replay_fd, hdr, sizeof(hdr)) != sizeof(hdr)) ||
+		memcmp(hdr, TRACE_MAGIC, 4) || (hdr[4] != TRACE_VERSION)){
+		close(replay_fd);
+		replay_fd = -1;
+		errno = EINVAL;
+		return -1;
+	}
+	replay_start_us = now_us();
+	return 0;
+}
+
+// append one chunk to the trace file, if recording.
+static void trace_chunk(int dir, const void* buf, int len){
+	unsigned char hdr[7];
+	uint64_t now;
+	uint32_t delta;
+	if((trace_fd == -1) || (len <= 0)) return;
+	now = now_us();
+	delta = (now - trace_last_us > 0xffffffff) ? 0xffffffff : (now - trace_last_us);
+	trace_last_us = now;
+	hdr[0] = delta >> 24;
+	hdr[1] = delta >> 16;
+	hdr[2] = delta >> 8;
+	hdr[3] = delta;
+	hdr[4] = dir;
+	hdr[5] = len >> 8;
+	hdr[6] = len;
+	write(trace_fd, hdr, sizeof(hdr));
+	write(trace_fd, buf, len);
+}
+
+// load the next replay record if the current one is used up.
+// returns 0, or -1 at end of trace.
+static int replay_fill(void){
+	unsigned char hdr[7];
+	if(replay_pos < replay_len) return 0;
+	if(read(replay_fd, hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+	replay_trace_us += ((uint32_t)hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+	replay_dir = hdr[4];
+	replay_len = (hdr[5] << 8) | hdr[6];
+	replay_pos = 0;
+	if(read(replay_fd, replay_chunk, replay_len) != replay_len) return -1;
+	replay_records++;
+	return 0;
+}
+
+// stands in for write() while replaying.  Discards any RX the parser
+//  didn't consume, then checks buf against the recorded TX chunk.
+static int replay_write(const char* buf, int size){
+	while(!replay_fill() && (replay_dir == TRACE_RX))
+		replay_pos = replay_len;
+	if((replay_dir != TRACE_TX) || (replay_len - replay_pos != size) ||
+		memcmp(&replay_chunk[replay_pos], buf, size))
+		replay_tx_mismatch++;
+	replay_pos = replay_len;
+	return size;
+}
+
+// stands in for read() while replaying.
+//  If the trace says the SBC spoke next, nothing arrived: that's a timeout,
+//  same as a live read.
+static int replay_read(unsigned char* buf, int size){
+	int len;
+	if(replay_fill()){
+		errno = ENODATA;
+		return -1;
+	}
+	if(replay_dir != TRACE_RX){
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	len = replay_len - replay_pos;
+	if(len > size) len = size;
+	memcpy(buf, &replay_chunk[replay_pos], len);
+	replay_pos += len;
+	replay_rx_bytes += len;
+	return len;
+}
+
+// finish recording or report on the replay.
+void trace_close(void){
+	if(trace_fd != -1){
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	if(replay_fd != -1){
+		rec_begin("replay");
+		rec_int("REPLAY_RECORDS", replay_records);
+		rec_int("REPLAY_RX_BYTES", replay_rx_bytes);
+		rec_int("REPLAY_TX_MISMATCH", replay_tx_mismatch);
+		rec_int("REPLAY_TRACE_US", replay_trace_us);
+		rec_int("REPLAY_US", now_us() - replay_start_us);
+		rec_end(replay_tx_mismatch ? -1 : 0);
+	}
+}
+
+// Adaptive read timeouts
+//  Replies range from instant (ati) to tens of seconds (at+sbdix), so one
+//  fixed timeout is either too short or too long.  Each command class keeps
+//  a ring of its recent command-to-first-byte times.  The deadline for a
+//  reply is the class's LATENCY_PERCENTILE time * 1.5 + LATENCY_MARGIN_MS,
+//  clamped to the class limits.  The samples are saved in LATENCY_FILE.
+struct latency_class {
+	uint16_t count;                   // samples held, up to LATENCY_SAMPLES
+	uint16_t next;                    // ring index of the next sample
+	uint32_t ms[LATENCY_SAMPLES];
+};
+
+static struct latency_class latency[CMD_CLASSES];
+static int latency_dirty;
+
+// per class: deadline until enough samples, floor, and ceiling, in ms.
+//  A session that times out costs a second billable one, so CMD_SESSION
+//  never drops below its default.
+static const uint32_t latency_limits[CMD_CLASSES][3] = {
+	{  5000,  300,  15000 },          // CMD_QUICK
+	{ 10000,  500,  30000 },          // CMD_SIGNAL
+	{ 10000,  500,  30000 },          // CMD_TRANSFER
+	{ 90000, 90000, 120000 },         // CMD_SESSION
+};
+
+// the command whose reply read_raw_imu() is waiting on.
+static int pending_class = -1;
+static int pending_first;             // 1 until the first reply byte shows up.
+static uint64_t pending_sent_us;
+
+// sort the AT command in buf into a CMD_* class.
+static int command_class(const char* buf){
+	if(!strncasecmp(buf, "at+sbdix", 8)) return CMD_SESSION;
+	if(!strncasecmp(buf, "at+csq", 6)) return CMD_SIGNAL;
+	if(!strncasecmp(buf, "at+sbdw", 7) || !strncasecmp(buf, "at+sbdr", 7) ||
+		!strncasecmp(buf, "at+sbdd", 7) || !strncasecmp(buf, "at+sbdtc", 8))
+		return CMD_TRANSFER;
+	return CMD_QUICK;
+}
+
+static void latency_add(int cmd_class, uint32_t ms){
+	struct latency_class* lc = &latency[cmd_class];
+	lc->ms[lc->next] = ms;
+	lc->next = (lc->next + 1) % LATENCY_SAMPLES;
+	if(lc->count < LATENCY_SAMPLES) lc->count++;
+	latency_dirty = 1;
+}
+
+// returns how long to wait for the first byte of a cmd_class reply, in ms.
+int latency_deadline_ms(int cmd_class){
+	struct latency_class* lc = &latency[cmd_class];
+	uint32_t sorted[LATENCY_SAMPLES], t, deadline;
+	int i, j;
+
+	if(lc->count < LATENCY_MIN_SAMPLES)
+		return latency_limits[cmd_class][0];
+
+	// insertion sort, it's 32 numbers.
+	for(i = 0; i < lc->count; i++){
+		t = lc->ms[i];
+		for(j = i; (j > 0) && (sorted[j-1] > t); j--)
+			sorted[j] = sorted[j-1];
+		sorted[j] = t;
+	}
+	i = (lc->count * LATENCY_PERCENTILE + 99) / 100 - 1;
+	deadline = sorted[i] + sorted[i] / 2 + LATENCY_MARGIN_MS;
+
+	if(deadline < latency_limits[cmd_class][1]) deadline = latency_limits[cmd_class][1];
+	if(deadline > latency_limits[cmd_class][2]) deadline = latency_limits[cmd_class][2];
+	return deadline;
+}
+
+// read saved samples from LATENCY_FILE.
+// returns 0, or -1 if there is no usable file (defaults stay in effect).
+int latency_load(void){
+	unsigned char hdr[5];
+	struct latency_class saved[CMD_CLASSES];
+	int i, fd = open(LATENCY_FILE, O_RDONLY);
+	if(fd == -1) return -1;
+	if((read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) || memcmp(hdr, LATENCY_MAGIC, 4) ||
+		(hdr[4] != LATENCY_VERSION) || (read(fd, saved, sizeof(saved)) != sizeof(saved))){
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	for(i = 0; i < CMD_CLASSES; i++)
+		if((saved[i].count > LATENCY_SAMPLES) || (saved[i].next >= LATENCY_SAMPLES))
+			return -1;
+	memcpy(latency, saved, sizeof(latency));
+	return 0;
+}
+
+// write samples to LATENCY_FILE if anything was learned this run.
+//  Goes through a temp file so a crash can't leave half a file behind.
+int latency_save(void){
+	char tmpname[] = LATENCY_FILE ".XXXXXX";
+	unsigned char version = LATENCY_VERSION;
+	int fd, err = 0;
+	if(!latency_dirty) return 0;
+	fd = mkstemp(tmpname);
+	if(fd == -1) return -1;
+	fchmod(fd, 0644);
+	if((write(fd, LATENCY_MAGIC, 4) != 4) || (write(fd, &version, 1) != 1) ||
+		(write(fd, latency, sizeof(latency)) != sizeof(latency)))
+		err = -1;
+	close(fd);
+	if(err || rename(tmpname, LATENCY_FILE)){
+		unlink(tmpname);
+		return -1;
+	}
+	latency_dirty = 0;
+	return 0;
+}
+
+static void latency_save_atexit(void){
+	latency_save();
+}
+
+// Output records
+//  Every option that runs produces one record: the op name, its fields,
+//  how long it took and an error code.  In text mode (the default) fields
+//  print as KEY=VALUE on stderr exactly as they always have and binary data
+//  goes raw to stdout.  With -F json or -F cbor the fields are collected and
+//  the whole record is written in one go to stdout, or wherever -o points.
+//  That can be a file or unix:<path> for a stream socket.  Keys are the
+//  same in every format.
+static int out_format = FMT_TEXT;
+static int out_fd = STDOUT_FILENO;
+static unsigned char rec_buf[REC_MAX];
+static int rec_len;
+static int rec_open;
+static const char* rec_op;
+static uint64_t rec_start_us;
+static int rec_faults;
+static const char* rec_last_fault;
+static const char* rec_last_recovery;
+
+// -F text|json|cbor.  returns 0, or -1 if name isn't a format.
+int out_set_format(char* name){
+	if(!strcmp(name, "text")) out_format = FMT_TEXT;
+	else if(!strcmp(name, "json")) out_format = FMT_JSON;
+	else if(!strcmp(name, "cbor")) out_format = FMT_CBOR;
+	else return -1;
+	return 0;
+}
+
+// -o <file> or -o unix:<path>.  returns 0 or -1.
+int out_open(char* spec){
+	struct sockaddr_un addr = { AF_UNIX };
+	int fd;
+	if(!strncmp(spec, "unix:", 5)){
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd == -1) return -1;
+		strncpy(addr.sun_path, &spec[5], sizeof(addr.sun_path) - 1);
+		if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))){
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		fd = open(spec, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(fd == -1) return -1;
+	}
+	out_fd = fd;
+	return 0;
+}
+
+static void rec_put(const void* data, int len){
+	if(rec_len + len > REC_MAX - 2) return; // keep room to close the record.
+	memcpy(&rec_buf[rec_len], data, len);
+	rec_len += len;
+}
+
+static void cbor_head(int major, uint64_t value){
+	unsigned char head[9];
+	int i, n;
+	if(value < 24){
+		head[0] = (major << 5) | value;
+		n = 0;
+	}
+	else {
+		n = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
+		head[0] = (major << 5) | ((n == 1) ? 24 : (n == 2) ? 25 : (n == 4) ? 26 : 27);
+		for(i = 0; i < n; i++) head[1+i] = value >> (8 * (n - 1 - i));
+	}
+	rec_put(head, n + 1);
+}
+
+static void json_string(const char* str, int len){
+	char esc[8];
+	int i;
+	rec_put("\"", 1);
+	for(i = 0; i < len; i++){
+		unsigned char ch = str[i];
+		if((ch == '"') || (ch == '\\')){
+			esc[0] = '\\';
+			esc[1] = ch;
+			rec_put(esc, 2);
+		}
+		else if((ch < 0x20) || (ch >= 0x7f)){
+			sprintf(esc, "\\u%04x", ch);
+			rec_put(esc, 6);
+		}
+		else rec_put(&ch, 1);
+	}
+	rec_put("\"", 1);
+}
+
+// start a field: key and separator.
+static void rec_key(const char* key){
+	if(out_format == FMT_JSON){
+		rec_put(",", 1);
+		json_string(key, strlen(key));
+		rec_put(":", 1);
+	}
+	else {
+		cbor_head(3, strlen(key));
+		rec_put(key, strlen(key));
+	}
+}
+
+void rec_begin(const char* op){
+	rec_op = op;
+	rec_start_us = now_us();
+	rec_faults = 0;
+	rec_last_fault = rec_last_recovery = NULL;
+	rec_open = 1;
+	if(out_format == FMT_TEXT) return;
+	rec_len = 0;
+	if(out_format == FMT_JSON){
+		rec_put("{\"op\":", 6);
+		json_string(op, strlen(op));
+	}
+	else {
+		rec_put("\xbf", 1); // indefinite length map.
+		cbor_head(3, 2);
+		rec_put("op", 2);
+		cbor_head(3, strlen(op));
+		rec_put(op, strlen(op));
+	}
+}
+
+void rec_int(const char* key, long long value){
+	char num[24];
+	if(out_format == FMT_TEXT){
+		fprintf(stderr, "%s=%lld\n", key, value);
+		return;
+	}
+	rec_key(key);
+	if(out_format == FMT_JSON){
+		sprintf(num, "%lld", value);
+		rec_put(num, strlen(num));
+	}
+	else if(value >= 0) cbor_head(0, value);
+	else cbor_head(1, -1 - value);
+}
+
+void rec_str(const char* key, const char* value){
+	if(out_format == FMT_TEXT){
+		fprintf(stderr, "%s=%s\n", key, value);
+		return;
+	}
+	rec_key(key);
+	if(out_format == FMT_JSON) json_string(value, strlen(value));
+	else {
+		cbor_head(3, strlen(value));
+		rec_put(value, strlen(value));
+	}
+}
+
+// same as rec_str() but quoted in text mode, for free-form text.
+void rec_text(const char* key, const char* value){
+	if(out_format == FMT_TEXT)
+		fprintf(stderr, "%s=\"%s\"\n", key, value);
+	else rec_str(key, value);
+}
+
+void rec_float(const char* key, double value, int prec){
+	char num[40];
+	unsigned char dbl[9];
+	uint64_t bits;
+	int i;
+	if(out_format == FMT_TEXT){
+		fprintf(stderr, "%s=%.*f\n", key, prec, value);
+		return;
+	}
+	rec_key(key);
+	if(out_format == FMT_JSON){
+		snprintf(num, sizeof(num), "%.*f", prec, value);
+		rec_put(num, strlen(num));
+	}
+	else {
+		memcpy(&bits, &value, sizeof(bits));
+		dbl[0] = 0xfb;
+		for(i = 0; i < 8; i++) dbl[1+i] = bits >> (56 - 8*i);
+		rec_put(dbl, sizeof(dbl));
+	}
+}
+
+// binary data.  Raw to stdout in text mode, base64 in JSON, a byte string in CBOR.
+void rec_bytes(const char* key, const unsigned char* buf, int len){
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char quad[4];
+	uint32_t v;
+	int i;
+	if(out_format == FMT_TEXT){
+		write(STDOUT_FILENO, buf, len);
+		return;
+	}
+	rec_key(key);
+	if(out_format == FMT_CBOR){
+		cbor_head(2, len);
+		rec_put(buf, len);
+		return;
+	}
+	rec_put("\"", 1);
+	for(i = 0; i < len; i += 3){
+		v = buf[i] << 16;
+		if(i + 1 < len) v |= buf[i+1] << 8;
+		if(i + 2 < len) v |= buf[i+2];
+		quad[0] = b64[(v >> 18) & 0x3f];
+		quad[1] = b64[(v >> 12) & 0x3f];
+		quad[2] = (i + 1 < len) ? b64[(v >> 6) & 0x3f] : '=';
+		quad[3] = (i + 2 < len) ? b64[v & 0x3f] : '=';
+		rec_put(quad, 4);
+	}
+	rec_put("\"", 1);
+}
+
+// faults and recovery steps can happen several times in one op, so records
+//  get a count and the last of each rather than repeated keys.
+void rec_fault(const char* fault){
+	if(out_format == FMT_TEXT) fprintf(stderr, "FAULT=%s\n", fault);
+	rec_faults++;
+	rec_last_fault = fault;
+}
+
+void rec_recovery(const char* step){
+	if(out_format == FMT_TEXT) fprintf(stderr, "RECOVERY=%s\n", step);
+	rec_last_recovery = step;
+}
+
+// finish the record with timing and err (0 for success) and send it.
+void rec_end(int err){
+	if(!rec_open) return;
+	rec_open = 0;
+	if(out_format == FMT_TEXT) return;
+	rec_int("ELAPSED_US", now_us() - rec_start_us);
+	rec_int("ERROR", err);
+	if(rec_faults){
+		rec_int("FAULTS", rec_faults);
+		rec_str("LAST_FAULT", rec_last_fault);
+		if(rec_last_recovery) rec_str("RECOVERY", rec_last_recovery);
+	}
+	if(out_format == FMT_JSON) rec_len += sprintf((char*)&rec_buf[rec_len], "}\n");
+	else rec_buf[rec_len++] = 0xff;
+	write(out_fd, rec_buf, rec_len);
+}
+
 // setup functions
 
 int serial_init(int fd)
@@ -39,7 +556,7 @@ int serial_init(int fd)
 
 	if(tcgetattr(fd, &options)){
 		fprintf(stderr, "There was an error setting up the serial port.  %s\n", strerror(errno));
-		abort();
+		return -1;
 	}
 
 	cfsetispeed(&options,BAUD);
@@ -59,6 +576,7 @@ int serial_init(int fd)
   	//   Downside:  read quits as soon as VMIN is hit.  Max VMIN is 255.
   	options.c_cc[VMIN] = 255;   // 255 is maximum vmin.
   	options.c_cc[VTIME] = 1; // read timeout in 1/10 seconds of no (more) data.
+  	//  How long to wait for the first char is up to read_raw_imu()'s learned deadlines.
  
  	err=tcsetattr(fd, TCSANOW, &options);
 
@@ -70,9 +588,10 @@ int serial_init(int fd)
 int set_serial_mode(int fd, int option){
 	struct termios options;
 	int err;
+	if(fd == replay_fd) return 0; // no port behind a replay.
 	if(tcgetattr(fd, &options)){
 		fprintf(stderr, "Error, could not set port options.  %s\n", strerror(errno));
-		abort();
+		return -1;
 	}
 	if(option==TEXT_MODE)
 		options.c_cflag &= ~ICANON;
@@ -148,40 +667,121 @@ int check_binary(char* buf, int buf_len){
 //  Fancy:  tcdrain() makes sure the function doesn't return
 //		until the driver is done writting to hardware.
 int write_to_imu(const char* buf, int size, int fd){
+	int bitcount;
+	if(replay_fd != -1)
+		return replay_write(buf, size);
 	// serial write 
-	int bitcount=write(fd, buf, size);
+	bitcount=write(fd, buf, size);
 	tcdrain(fd); // wait for serial port to finish transmitting.
+	trace_chunk(TRACE_TX, buf, bitcount);
+
+	// start the reply clock.  Payload after READY keeps its command's class.
+	if((size >= 2) && !strncasecmp(buf, "at", 2))
+		pending_class = command_class(buf);
+	pending_first = 1;
+	pending_sent_us = now_us();
 
 	return bitcount;
 }
 
+// All serial reads go through here so they can be traced or replayed.
+int read_raw_imu(int fd, unsigned char* buf, int size){
+	int count;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int64_t wait_ms = LATENCY_GAP_MS;
+	int deadline = 0;
+	uint64_t now;
+
+	if(replay_fd != -1)
+		return replay_read(buf, size);
+
+	// first byte of a reply gets the learned deadline, the rest get LATENCY_GAP_MS.
+	if(pending_first && (pending_class != -1)){
+		deadline = latency_deadline_ms(pending_class);
+		wait_ms = deadline - (int64_t)(now_us() - pending_sent_us) / 1000;
+		if(wait_ms < 0) wait_ms = 0;
+	}
+	count = poll(&pfd, 1, wait_ms);
+	if(count == 0){
+		// a reply that never came took at least the deadline.  Count it, or a
+		//  link that slowed down would never get a longer one.
+		if(deadline){
+			latency_add(pending_class, deadline);
+			pending_first = 0;
+		}
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if(count < 0) return count;
+
+	now = now_us();
+	count = read(fd, buf, size);
+	trace_chunk(TRACE_RX, buf, count);
+	if((count > 0) && pending_first){
+		if(pending_class != -1)
+			latency_add(pending_class, (now - pending_sent_us) / 1000);
+		pending_first = 0;
+	}
+	return count;
+}
+
+// Reads the MT buffer as binary.  Retries in place if the length, data or
+//  checksum don't come through right.
+// returns number of bytes in buf including checksum, or -1.
 int read_binary_from_imu(unsigned char* buf, int fd){
-	int i, i2;
+	int i, i2, attempt, fault;
 	uint8_t size_hb, size_lb;
 	uint16_t size = 0;
+	uint16_t checksum;
 
-	write_to_imu("at+sbdrb\r\n", strlen("at+sbdrb\r\n"), fd);
+	for(attempt = 0; attempt < RETRY_MAX; attempt++){
+		if(write_to_imu("at+sbdrb\r\n", strlen("at+sbdrb\r\n"), fd) < 0){
+			fault = FAULT_IO;
+			goto recover;
+		}
 
-	set_serial_mode(fd, BIN_MODE);
-	i = read(fd, buf, 2);
-	size_hb = buf[0];
-	size_lb = buf[1];
-	size = buf[0] << 8;
-	size += buf[1];
+		set_serial_mode(fd, BIN_MODE);
+		i = read_raw_imu(fd, buf, 2);
+		size_hb = buf[0];
+		size_lb = buf[1];
+		size = buf[0] << 8;
+		size += buf[1];
+
+		fault = FAULT_NONE;
+		if(i < 0)
+			fault = (errno == ETIMEDOUT) ? FAULT_TIMEOUT : FAULT_IO;
+		else if((i != 2) || (size > MAX_BUFF - 2))
+			fault = FAULT_DESYNC;
+		else {
+			// now we know how many bytes to read, add 2 bytes for checksum.
+			i = read_raw_imu(fd, buf, size+2);
+
+			// the rest can come in several pieces, keep reading where we left off.
+			while((i >= 0) && (i < size+2)){
+				i2 = read_raw_imu(fd, &buf[i], (size-i+2));
+				if(i2 <= 0) break;
+				i += i2;
+			}
+
+			if(i != size+2)
+				fault = FAULT_TIMEOUT;
+			else {
+				checksum = 0;
+				for(i2 = 0; i2 < size; i2++) checksum += buf[i2];
+				if(checksum != ((buf[size] << 8) | buf[size+1]))
+					fault = FAULT_CHECKSUM;
+			}
+		}
 
-	// now we know how many bytes to read, add 2 bytes for checksum.
-	i = read(fd, buf, size+2);
+		// turn off bin mode when done.
+		set_serial_mode(fd, TEXT_MODE);
 
-	// Check if there is more in the buffer and read that in where we left off.
-	if(i < size+2){
-		i2 = read(fd, &buf[i], (size-i+2));
+		// return number of bytes in buf, including checksum.
+		if(fault == FAULT_NONE) return size+2;
+recover:
+		if(imu_recover(fd, fault, attempt)) break;
 	}
-
-	// turn off bin mode when done.
-	set_serial_mode(fd, TEXT_MODE);
-
-	// return number of bytes in buf, including checksum.
-	return size+2;
+	return -1;
 }
 
 // read_from_imu
@@ -207,7 +807,7 @@ int read_from_imu(unsigned char* buf, int fd){
 	for(i = 0; i < MAX_BUFF; i++) buf[i] = '\0';
 	bzero(temp_buff, sizeof(char[MAX_BUFF]));
 	
-	count = read(fd, buf, MAX_BUFF); // lol I should be so lucky if only one read.
+	count = read_raw_imu(fd, buf, MAX_BUFF); // lol I should be so lucky if only one read.
 
 	size_hb = buf[0];
 	size_lb = buf[1];
@@ -227,14 +827,21 @@ int read_from_imu(unsigned char* buf, int fd){
 		count2 = check_binary(buf, size);
 		if(count2 == count)
 			return count;  // Binary check good, return out.
-		else
-			return count2; // Binary check bad, return error.
+		errno = EBADMSG;
+		return count2; // Binary check bad, return error.
+	}
+
+	// Length can't be right, we're out of step with the modem.
+	if(size + 4 > MAX_BUFF){
+		errno = EBADMSG;
+		return -1;
 	}
 
 	// Read again.  There's probably more data coming.
 	while(count != (size+4)) {
 		count2 = 0;
-		count2=read(fd, temp_buff, (MAX_BUFF - count)); // only read what we have room for.
+		count2=read_raw_imu(fd, temp_buff, (MAX_BUFF - count)); // only read what we have room for.
+		if(count2 <= 0) return -1; // reply stalled partway.
 		strncat(buf, temp_buff, count2); 
 		count += count2;
 	}
@@ -245,109 +852,1176 @@ int read_from_imu(unsigned char* buf, int fd){
 }
 
 // Combines imu write & read, takes command, modifies buffer, returns buffer size.
-//  Dies violently on error.
+//  On timeout, ERROR, a garbled reply or a dead port it recovers and retries
+//  in place.  Returns -1 if the modem can't be brought back.
 // Why?
 //  Typically writing to the SBD will generate some sort of immediate response.
 //  That response will need to be parsed.  Therefore it makes sense to immediately
 //  follow an SBD write with an SBD read.
 int imu_rw(const char* command, char* buf, int fd){
-	int size;
-	size=write_to_imu(command, strlen(command), fd);
-	if(size<0) {
-		fprintf(stderr, "Failed to write to IMU. %s\n", strerror(errno));
-		abort();
+	int size, fault, attempt;
+	for(attempt = 0; attempt < RETRY_MAX; attempt++){
+		size=write_to_imu(command, strlen(command), fd);
+		if(size<0) {
+			fprintf(stderr, "Failed to write to IMU. %s\n", strerror(errno));
+			fault = FAULT_IO;
+		}
+		else {
+			size= read_from_imu(buf, fd);
+			fault = imu_fault(size, buf);
+			if(fault == FAULT_NONE) return size;
+		}
+		if(imu_recover(fd, fault, attempt)) break;
 	}
-	size= read_from_imu(buf, fd);
+	return -1;
+}
 
-	return size;
+// Fault recovery
+//  Most faults are a lost or late reply, so the first response is a resync:
+//  flush both directions, send RESYNC_PROBE, and check that the modem answers.
+//  If the probe gets nothing, or the same exchange has already failed once
+//  after a resync, escalate to reinit_port(): reopen the port and send the
+//  init string again.  Only if that fails too does the caller see an error.
+#define RECOVER_RESYNC 0
+#define RECOVER_REINIT 1
+#define RECOVER_FAILED 2
+
+static const char* fault_names[] = {
+	"NONE", "TIMEOUT", "ERROR", "CHECKSUM", "SIZE", "DESYNC", "IO"
+};
+
+// the port open_sbd_port() used, for reinit_port(), and the descriptor that
+//  holds its lock for as long as we run.
+static char sbd_port[64];
+static int sbd_lock_fd = -1;
+
+// classify the result of read_from_imu().
+int imu_fault(int size, const char* buf){
+	if(size < 0){
+		if(errno == ETIMEDOUT) return FAULT_TIMEOUT;
+		if(errno == EBADMSG) return FAULT_DESYNC;
+		return FAULT_IO;
+	}
+	if(!strncmp(buf, "ERROR", 5)) return FAULT_ERROR;
+	return FAULT_NONE;
+}
+
+// flush, probe, and confirm the modem is talking to us again.
+static int resync(int fd){
+	unsigned char buf[MAX_BUFF];
+	int len;
+	tcflush(fd, TCIOFLUSH);
+	if(write_to_imu(RESYNC_PROBE, strlen(RESYNC_PROBE), fd) < 0) return -1;
+	len = read_from_imu(buf, fd);
+	if((len < 0) || (imu_fault(len, buf) != FAULT_NONE)) return -1;
+	tcflush(fd, TCIFLUSH); // anything late from the failed exchange.
+	return 0;
+}
+
+// Close and reopen the port on the same fd number, so callers' fd stays good,
+//  then redo serial_init() and setup_modem().  There's no port to reopen
+//  during a replay, so only the init string is sent.
+// returns 0 or -1.
+int reinit_port(int fd){
+	int newfd;
+	if(fd != replay_fd){
+		newfd = open(sbd_port, O_RDWR | O_NOCTTY);
+		if(newfd == -1) return -1;
+		if(dup2(newfd, fd) == -1){
+			close(newfd);
+			return -1;
+		}
+		close(newfd);
+		if(serial_init(fd)) return -1;
+	}
+	if(setup_modem(fd) == -1) return -1;
+	return 0;
+}
+
+// Bring the modem back after fault.  attempt counts earlier tries of the
+//  same exchange.
+// returns 0 when it's safe to retry, -1 if the modem couldn't be recovered.
+int imu_recover(int fd, int fault, int attempt){
+	int state = RECOVER_RESYNC;
+
+	rec_fault(fault_names[fault]);
+
+	// size is wrong no matter how often we send it.
+	if(fault == FAULT_SIZE) return -1;
+	if((fault == FAULT_IO) || (attempt > 0)) state = RECOVER_REINIT;
+
+	while(1){
+		switch(state){
+			case RECOVER_RESYNC:
+				rec_recovery("RESYNC");
+				if(!resync(fd)) return 0;
+				state = RECOVER_REINIT;
+				break;
+			case RECOVER_REINIT:
+				rec_recovery("REINIT");
+				if(!reinit_port(fd) && !resync(fd)) return 0;
+				state = RECOVER_FAILED;
+				break;
+			default:
+				rec_recovery("FAILED");
+				return -1;
+		}
+	}
 }
 
 // Request RSSI from modem.
 // at+csq
 // Return int 1-5, or return < 0 if err.
 int get_rssi(int fd){
-	int length;
 	unsigned char buf[MAX_BUFF] = {'\0'};
 	int i = 0;
-	length=imu_rw("at+csq\r\n", buf, fd);
+	if(imu_rw("at+csq\r\n", buf, fd) < 0) return -1;
 	
 	// use sscanf to grab the number after +CSQ:.
-	sscanf(buf, "+CSQ:%d", &i);
-
+	if(sscanf(buf, "+CSQ:%d", &i) != 1) return -1;
+	hist_add(HIST_RSSI, i, 0);
+	board_rssi(i);
 	return i;
 }
 
-// Front-end functions
+// Payload envelope
+//  With a key loaded (-K), binary MO messages are sealed and MT messages are
+//  opened with ChaCha20-Poly1305 (RFC 8439).  Only 12 bytes of the 340 go to
+//  the envelope:
+//   <4 byte counter> <ciphertext> <8 byte truncated tag>
+//  The 96-bit nonce is <direction byte> <7 zero bytes> <counter>, so it's never
+//  sent in full.  MO counters are the MOMSN the message will go out under,
+//  with the high 16 bits bumped whenever that would not be larger than the
+//  last counter used, so a nonce is never reused across MOMSN wraps or
+//  resends.  MT counters must increase too, so an old command can't be
+//  replayed.  Both last counters live in <keyfile>.ctr.
+//
+//  Everything here is constant time: ChaCha20 is add/rotate/xor and
+//  Poly1305 uses 26-bit limbs with 32x32->64 multiplies, which suits the
+//  ARM SBCs without needing a crypto library.
+static unsigned char aead_key[AEAD_KEY_LEN];
+static int aead_on;
+static char aead_state[256];
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8);  \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+static uint32_t le32(const unsigned char* p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(unsigned char* p, uint32_t v){
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void chacha20_block(const unsigned char* key, uint32_t counter,
+	const unsigned char* nonce, unsigned char* out){
+	uint32_t in[16], x[16];
+	int i;
+	in[0] = 0x61707865;  // "expand 32-byte k"
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for(i = 0; i < 8; i++) in[4+i] = le32(&key[4*i]);
+	in[12] = counter;
+	for(i = 0; i < 3; i++) in[13+i] = le32(&nonce[4*i]);
+	memcpy(x, in, sizeof(x));
+	for(i = 0; i < 10; i++){
+		QR(x[0], x[4], x[8],  x[12]);
+		QR(x[1], x[5], x[9],  x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8],  x[13]);
+		QR(x[3], x[4], x[9],  x[14]);
+	}
+	for(i = 0; i < 16; i++) put_le32(&out[4*i], x[i] + in[i]);
+}
+
+static void chacha20_xor(const unsigned char* key, uint32_t counter,
+	const unsigned char* nonce, unsigned char* buf, int len){
+	unsigned char ks[64];
+	int i, j;
+	for(i = 0; i < len; i += 64, counter++){
+		chacha20_block(key, counter, nonce, ks);
+		for(j = 0; (j < 64) && (i + j < len); j++) buf[i+j] ^= ks[j];
+	}
+}
+
+// Poly1305 over msg, len a multiple of 16 (the AEAD pads it that way).
+static void poly1305(const unsigned char* key, const unsigned char* msg, int len,
+	unsigned char* tag){
+	uint32_t r0, r1, r2, r3, r4, s1, s2, s3, s4;
+	uint32_t h0 = 0, h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+	uint32_t g0, g1, g2, g3, g4, c, mask;
+	uint64_t d0, d1, d2, d3, d4, f;
+
+	r0 = (le32(&key[0])     ) & 0x3ffffff;
+	r1 = (le32(&key[3]) >> 2) & 0x3ffff03;
+	r2 = (le32(&key[6]) >> 4) & 0x3ffc0ff;
+	r3 = (le32(&key[9]) >> 6) & 0x3f03fff;
+	r4 = (le32(&key[12]) >> 8) & 0x00fffff;
+	s1 = r1 * 5;
+	s2 = r2 * 5;
+	s3 = r3 * 5;
+	s4 = r4 * 5;
+
+	for(; len >= 16; msg += 16, len -= 16){
+		h0 += (le32(&msg[0])     ) & 0x3ffffff;
+		h1 += (le32(&msg[3]) >> 2) & 0x3ffffff;
+		h2 += (le32(&msg[6]) >> 4) & 0x3ffffff;
+		h3 += (le32(&msg[9]) >> 6) & 0x3ffffff;
+		h4 += (le32(&msg[12]) >> 8) | (1 << 24);
+
+		d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+		d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+		d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+		d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+		d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+		c = d0 >> 26; h0 = d0 & 0x3ffffff; d1 += c;
+		c = d1 >> 26; h1 = d1 & 0x3ffffff; d2 += c;
+		c = d2 >> 26; h2 = d2 & 0x3ffffff; d3 += c;
+		c = d3 >> 26; h3 = d3 & 0x3ffffff; d4 += c;
+		c = d4 >> 26; h4 = d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+	}
+
+	// full carry, then h - p if h >= p, without branching on h.
+	c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+	c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+	c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+	c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+	c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1 << 26);
+
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	// h + s mod 2^128
+	h0 = h0 | (h1 << 26);
+	h1 = (h1 >> 6) | (h2 << 20);
+	h2 = (h2 >> 12) | (h3 << 14);
+	h3 = (h3 >> 18) | (h4 << 8);
+	f = (uint64_t)h0 + le32(&key[16]);             put_le32(&tag[0], f);
+	f = (uint64_t)h1 + le32(&key[20]) + (f >> 32); put_le32(&tag[4], f);
+	f = (uint64_t)h2 + le32(&key[24]) + (f >> 32); put_le32(&tag[8], f);
+	f = (uint64_t)h3 + le32(&key[28]) + (f >> 32); put_le32(&tag[12], f);
+}
+
+// RFC 8439 AEAD tag over aad and ciphertext ct.
+static void aead_tag(const unsigned char* key, const unsigned char* nonce,
+	const unsigned char* aad, int aadlen, const unsigned char* ct, int len,
+	unsigned char* tag){
+	unsigned char otk[64];
+	unsigned char mac[16 + MAX_BUFF + 32] = { 0 };
+	int n;
+	chacha20_block(key, 0, nonce, otk);
+	memcpy(mac, aad, aadlen);
+	n = (aadlen + 15) & ~15;
+	memcpy(&mac[n], ct, len);
+	n += (len + 15) & ~15;
+	put_le32(&mac[n], aadlen);
+	put_le32(&mac[n+8], len);
+	poly1305(otk, mac, n + 16, tag);
+}
+
+// encrypt buf in place and produce its tag.
+static void aead_seal(const unsigned char* key, const unsigned char* nonce,
+	const unsigned char* aad, int aadlen, unsigned char* buf, int len, unsigned char* tag){
+	chacha20_xor(key, 1, nonce, buf, len);
+	aead_tag(key, nonce, aad, aadlen, buf, len, tag);
+}
+
+// check taglen bytes of tag, then decrypt buf in place.
+// returns 0, or -1 (buf untouched) if it doesn't authenticate.
+static int aead_open(const unsigned char* key, const unsigned char* nonce,
+	const unsigned char* aad, int aadlen, unsigned char* buf, int len,
+	const unsigned char* tag, int taglen){
+	unsigned char calc[16];
+	unsigned char diff = 0;
+	int i;
+	aead_tag(key, nonce, aad, aadlen, buf, len, calc);
+	for(i = 0; i < taglen; i++) diff |= calc[i] ^ tag[i];
+	if(diff) return -1;
+	chacha20_xor(key, 1, nonce, buf, len);
+	return 0;
+}
+
+static void envelope_nonce(unsigned char* nonce, int dir, uint32_t ctr){
+	bzero(nonce, 12);
+	nonce[0] = dir;
+	nonce[8] = ctr >> 24;
+	nonce[9] = ctr >> 16;
+	nonce[10] = ctr >> 8;
+	nonce[11] = ctr;
+}
+
+// last MO and MT counters, from <keyfile>.ctr.  Only a key that's never
+//  been used starts from zero.  Zeroing the counters of one that has would
+//  reuse nonces and let old MT messages back in.
+// returns 0, or -1 if the file is there but can't be read in full.
+static int aead_state_load(uint32_t* ctr){
+	int fd = open(aead_state, O_RDONLY);
+	ctr[0] = ctr[1] = 0;
+	if(fd == -1) return (errno == ENOENT) ? 0 : -1;
+	if(read(fd, ctr, 2 * sizeof(uint32_t)) != 2 * sizeof(uint32_t)){
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// write the counters back, by way of a temp file and rename() so a crash
+//  leaves either the old counters or the new ones.
+static int aead_state_save(const uint32_t* ctr){
+	char tmpname[sizeof(aead_state) + 8];
+	int fd, err = 0;
+	snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", aead_state);
+	fd = mkstemp(tmpname);
+	if(fd == -1) return -1;
+	fchmod(fd, 0600);
+	if((write(fd, ctr, 2 * sizeof(uint32_t)) != 2 * sizeof(uint32_t)) || fsync(fd))
+		err = -1;
+	close(fd);
+	if(err || rename(tmpname, aead_state)){
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+// read a raw 32 byte key from filename and turn the envelope on.
+// returns 0 or -1.
+int aead_load_key(char* filename){
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1) return -1;
+	if(read(fd, aead_key, AEAD_KEY_LEN) != AEAD_KEY_LEN){
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	close(fd);
+	snprintf(aead_state, sizeof(aead_state), "%s" AEAD_STATE_EXT, filename);
+	aead_on = 1;
+	return 0;
+}
+
+// seal len bytes of in into out for sending under momsn.
+// returns envelope length, or -1 if it won't fit or the counter can't be
+//  loaded or saved.
+int envelope_seal(unsigned char* out, const unsigned char* in, int len, uint16_t momsn){
+	unsigned char nonce[12], tag[16];
+	uint32_t ctr[2], next;
+
+	if(len + AEAD_OVERHEAD > MAXBYTES) return -1;
+	if(aead_state_load(ctr)) return -1;
+	next = (ctr[0] & 0xffff0000) | momsn;
+	if(next <= ctr[0]) next += 0x10000;
+	ctr[0] = next;
+	// counter hits the disk before it hits the air.
+	if(aead_state_save(ctr)) return -1;
+
+	out[0] = next >> 24;
+	out[1] = next >> 16;
+	out[2] = next >> 8;
+	out[3] = next;
+	memcpy(&out[AEAD_CTR_LEN], in, len);
+	envelope_nonce(nonce, AEAD_DIR_MO, next);
+	aead_seal(aead_key, nonce, NULL, 0, &out[AEAD_CTR_LEN], len, tag);
+	memcpy(&out[AEAD_CTR_LEN + len], tag, AEAD_TAG_LEN);
+	return len + AEAD_OVERHEAD;
+}
+
+// open an MT envelope of len bytes from in into out.
+// returns plaintext length, or -1 if it's short, forged or replayed, or the
+//  counter can't be loaded or saved.
+int envelope_open(unsigned char* out, const unsigned char* in, int len){
+	unsigned char nonce[12];
+	uint32_t ctr[2], got;
+
+	len -= AEAD_OVERHEAD;
+	if(len < 0) return -1;
+	got = ((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+	if(aead_state_load(ctr) || (got <= ctr[1])) return -1;
+
+	memcpy(out, &in[AEAD_CTR_LEN], len);
+	envelope_nonce(nonce, AEAD_DIR_MT, got);
+	if(aead_open(aead_key, nonce, NULL, 0, out, len, &in[AEAD_CTR_LEN + len], AEAD_TAG_LEN))
+		return -1;
+	ctr[1] = got;
+	if(aead_state_save(ctr)) return -1;
+	return len;
+}
+
+static uint64_t cpu_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// -B: bytes of overhead and CPU time per full-size message.
+void bench(void){
+	unsigned char key[AEAD_KEY_LEN], nonce[12], tag[16];
+	unsigned char buf[MAX_BUFF], work[MAX_BUFF];
+	int i, len = MAXBYTES - AEAD_OVERHEAD;
+	uint64_t t;
+
+	for(i = 0; i < AEAD_KEY_LEN; i++) key[i] = i;
+	for(i = 0; i < len; i++) buf[i] = i;
+
+	t = cpu_us();
+	for(i = 0; i < BENCH_ROUNDS; i++){
+		envelope_nonce(nonce, AEAD_DIR_MO, i);
+		aead_seal(key, nonce, NULL, 0, buf, len, tag);
+	}
+	t = cpu_us() - t;
+	rec_int("AEAD_OVERHEAD_BYTES", AEAD_OVERHEAD);
+	rec_int("AEAD_PAYLOAD_BYTES", len);
+	rec_float("AEAD_SEAL_US", (double)t / BENCH_ROUNDS, 2);
+
+	// open the last one sealed over and over, from a fresh copy each time.
+	t = cpu_us();
+	for(i = 0; i < BENCH_ROUNDS; i++){
+		memcpy(work, buf, len);
+		if(aead_open(key, nonce, NULL, 0, work, len, tag, AEAD_TAG_LEN)) break;
+	}
+	t = cpu_us() - t;
+	rec_float("AEAD_OPEN_US", (double)t / BENCH_ROUNDS, 2);
+}
+
+// Forward error correction
+//  -X sends a transfer as k data messages plus n-k parity messages, and the
+//  receiver can rebuild it from any k of the n, so a message lost in a
+//  marginal pass costs a little extra airtime up front instead of another
+//  round trip through the gateway.  The code is a systematic Reed-Solomon
+//  erasure code over GF(256): parity message p is sum(D_i / (p ^ i)), a
+//  Cauchy matrix, which keeps every k-row subset of [identity; parity]
+//  invertible.  Each message starts with
+//   "FC" <2 byte id> <k> <n> <index> <2 byte transfer length>
+//  and the shards are all the same size, so the receiver learns it from the
+//  message length.
+static uint8_t gf_exp[510];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_tab[256][256];
+
+// tables for x^8 + x^4 + x^3 + x^2 + 1.
+static void gf_init(void){
+	static int done;
+	int i, j, x = 1;
+	if(done) return;
+	for(i = 0; i < 255; i++){
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if(x & 0x100) x ^= 0x11d;
+	}
+	for(i = 1; i < 256; i++)
+		for(j = 1; j < 256; j++)
+			gf_mul_tab[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+	done = 1;
+}
+
+static uint8_t gf_inv(uint8_t a){
+	return gf_exp[255 - gf_log[a]];
+}
+
+// dst += c * src, a byte at a time through the product table.
+static void gf_muladd(uint8_t* dst, const uint8_t* src, uint8_t c, int len){
+	const uint8_t* t = gf_mul_tab[c];
+	int i;
+	if(c == 0) return;
+	if(c == 1){
+		for(i = 0; i < len; i++) dst[i] ^= src[i];
+		return;
+	}
+	for(i = 0; i < len; i++) dst[i] ^= t[src[i]];
+}
+
+// coefficients that make shard index out of the k data shards.
+static void fec_row(uint8_t* row, int k, int index){
+	int i;
+	for(i = 0; i < k; i++)
+		row[i] = (index < k) ? (i == index) : gf_inv(index ^ i);
+}
+
+// fill parity shards k..n-1 from data shards 0..k-1, each len bytes.
+// returns 0 or -1 if k and n don't make a code.
+int fec_encode(unsigned char** shard, int k, int n, int len){
+	uint8_t row[FEC_MAX_N];
+	int i, p;
+	if((k < 1) || (n < k) || (n > FEC_MAX_N)) return -1;
+	gf_init();
+	for(p = k; p < n; p++){
+		fec_row(row, k, p);
+		bzero(shard[p], len);
+		for(i = 0; i < k; i++) gf_muladd(shard[p], shard[i], row[i], len);
+	}
+	return 0;
+}
+
+// rebuild the missing data shards in place.  have[i] is set for each of the
+//  n shards that arrived.
+// returns 0, or -1 if fewer than k arrived.
+int fec_decode(unsigned char** shard, const int* have, int k, int n, int len){
+	uint8_t m[FEC_MAX_N][FEC_MAX_N], inv[FEC_MAX_N][FEC_MAX_N], tmp[FEC_MAX_N];
+	int use[FEC_MAX_N];
+	int i, j, r, c, cnt = 0, missing = 0;
+	uint8_t f;
+
+	if((k < 1) || (n < k) || (n > FEC_MAX_N)) return -1;
+	gf_init();
+	// data shards come first, each one is an identity row that costs nothing.
+	for(i = 0; (i < n) && (cnt < k); i++)
+		if(have[i]) use[cnt++] = i;
+	if(cnt < k) return -1;
+	for(i = 0; i < k; i++)
+		if(!have[i]) missing++;
+	if(!missing) return 0;
+
+	// invert the rows we have, Gauss-Jordan.
+	for(r = 0; r < k; r++){
+		fec_row(m[r], k, use[r]);
+		for(c = 0; c < k; c++) inv[r][c] = (r == c);
+	}
+	for(c = 0; c < k; c++){
+		for(r = c; (r < k) && !m[r][c]; r++);
+		if(r == k) return -1;
+		if(r != c){
+			memcpy(tmp, m[r], k); memcpy(m[r], m[c], k); memcpy(m[c], tmp, k);
+			memcpy(tmp, inv[r], k); memcpy(inv[r], inv[c], k); memcpy(inv[c], tmp, k);
+		}
+		f = gf_inv(m[c][c]);
+		for(j = 0; j < k; j++){
+			m[c][j] = gf_mul_tab[f][m[c][j]];
+			inv[c][j] = gf_mul_tab[f][inv[c][j]];
+		}
+		for(r = 0; r < k; r++){
+			if((r == c) || !m[r][c]) continue;
+			f = m[r][c];
+			for(j = 0; j < k; j++){
+				m[r][j] ^= gf_mul_tab[f][m[c][j]];
+				inv[r][j] ^= gf_mul_tab[f][inv[c][j]];
+			}
+		}
+	}
+
+	for(i = 0; i < k; i++){
+		if(have[i]) continue;
+		bzero(shard[i], len);
+		for(j = 0; j < k; j++) gf_muladd(shard[i], shard[use[j]], inv[i][j], len);
+	}
+	return 0;
+}
+
+// -B: encode and decode time for a FEC_BENCH_K of FEC_BENCH_N transfer of
+//  full-size blocks, decoding with the first n-k data blocks lost.
+void fec_bench(void){
+	static unsigned char block[FEC_BENCH_N][MAXBYTES];
+	static unsigned char orig[FEC_BENCH_K][MAXBYTES];
+	unsigned char* shard[FEC_BENCH_N];
+	int have[FEC_BENCH_N];
+	int i, j, ok;
+	uint64_t t;
+
+	for(i = 0; i < FEC_BENCH_N; i++){
+		shard[i] = block[i];
+		have[i] = (i >= FEC_BENCH_N - FEC_BENCH_K);
+	}
+	for(i = 0; i < FEC_BENCH_K; i++)
+		for(j = 0; j < MAXBYTES; j++) block[i][j] = orig[i][j] = i * 31 + j;
+
+	t = cpu_us();
+	for(i = 0; i < BENCH_ROUNDS; i++) fec_encode(shard, FEC_BENCH_K, FEC_BENCH_N, MAXBYTES);
+	t = cpu_us() - t;
+	if(!t) t = 1;
+	rec_int("FEC_BLOCK_BYTES", MAXBYTES);
+	rec_int("FEC_K", FEC_BENCH_K);
+	rec_int("FEC_N", FEC_BENCH_N);
+	rec_float("FEC_ENCODE_US", (double)t / BENCH_ROUNDS, 2);
+	rec_float("FEC_ENCODE_MBPS", (double)FEC_BENCH_K * MAXBYTES * BENCH_ROUNDS / t, 1);
+
+	for(i = 0; i < FEC_BENCH_N - FEC_BENCH_K; i++) bzero(block[i], MAXBYTES);
+	t = cpu_us();
+	for(i = 0; i < BENCH_ROUNDS; i++)
+		fec_decode(shard, have, FEC_BENCH_K, FEC_BENCH_N, MAXBYTES);
+	t = cpu_us() - t;
+	if(!t) t = 1;
+	rec_float("FEC_DECODE_US", (double)t / BENCH_ROUNDS, 2);
+	rec_float("FEC_DECODE_MBPS", (double)FEC_BENCH_K * MAXBYTES * BENCH_ROUNDS / t, 1);
+	ok = !memcmp(block, orig, sizeof(orig));
+	rec_int("FEC_VERIFIED", ok);
+}
+
+// Geolocation and system time cache
+//  -MSGEO and -MSSTM only change after the modem has talked to the
+//  constellation, so they're refreshed after successful sessions (at most
+//  every GEO_REFRESH_AGE seconds) and kept in GEO_CACHE_FILE.  -g answers
+//  from the file while it's younger than the staleness bound and only asks
+//  the modem when it isn't.
+
+// Iridium system time is a count of 90 ms frames since IRIDIUM_EPOCH.
+int64_t iridium_to_unix_ms(uint32_t ticks){
+	return (int64_t)IRIDIUM_EPOCH * 1000 + (int64_t)ticks * IRIDIUM_TICK_MS;
+}
+
+// ECEF grid to geodetic lat/lon.  Only the direction of x,y,z matters, so
+//  the grid's units don't.  The fix is on the surface, which lets latitude
+//  be corrected for the ellipsoid without iterating.
+static void geo_convert(struct geo_cache* geo){
+	double p = sqrt((double)geo->x * geo->x + (double)geo->y * geo->y);
+	geo->lat = atan2(geo->z, p * (1.0 - WGS84_E2)) * 180.0 / M_PI;
+	geo->lon = atan2(geo->y, geo->x) * 180.0 / M_PI;
+}
+
+// read GEO_CACHE_FILE into geo.
+// returns 0, or -1 (geo zeroed) if there's no usable cache.
+int geo_load(struct geo_cache* geo){
+	unsigned char hdr[5];
+	int fd = open(GEO_CACHE_FILE, O_RDONLY);
+	bzero(geo, sizeof(*geo));
+	if(fd == -1) return -1;
+	if((read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) || memcmp(hdr, GEO_MAGIC, 4) ||
+		(hdr[4] != GEO_VERSION) || (read(fd, geo, sizeof(*geo)) != sizeof(*geo))){
+		close(fd);
+		bzero(geo, sizeof(*geo));
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// write geo to GEO_CACHE_FILE through a temp file.
+int geo_save(const struct geo_cache* geo){
+	char tmpname[] = GEO_CACHE_FILE ".XXXXXX";
+	unsigned char version = GEO_VERSION;
+	int fd, err = 0;
+	if(replay_fd != -1) return 0; // a replayed fix isn't where we are now.
+	fd = mkstemp(tmpname);
+	if(fd == -1) return -1;
+	fchmod(fd, 0644);
+	if((write(fd, GEO_MAGIC, 4) != 4) || (write(fd, &version, 1) != 1) ||
+		(write(fd, geo, sizeof(*geo)) != sizeof(*geo)))
+		err = -1;
+	close(fd);
+	if(err || rename(tmpname, GEO_CACHE_FILE)){
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+// ask the modem for -MSGEO and -MSSTM, update geo and the cache file.
+// returns 0, or -1 if the modem didn't answer.
+int geo_refresh(int fd, struct geo_cache* geo){
+	unsigned char buf[MAX_BUFF] = {'\0'};
+	unsigned int ticks;
+
+	// MSGEO=... Geolocation String x,y,z,timestamp. 	at-msgeo
+	if(imu_rw("at-msgeo\r\n", buf, fd) < 0) return -1;
+	geo->geo_valid = (sscanf(buf, "-MSGEO:%d,%d,%d,%x", &geo->x, &geo->y, &geo->z, &ticks) == 4) &&
+		(geo->x || geo->y || geo->z);
+	geo->geo_ticks = geo->geo_valid ? ticks : 0;
+	if(geo->geo_valid) geo_convert(geo);
+
+	// MSSTM=... <iridium system time in 90ms frames from iridium epoch>	at-msstm
+	//  Says "no network service" instead if the modem hasn't seen the constellation.
+	if(imu_rw("at-msstm\r\n", buf, fd) < 0) return -1;
+	geo->msstm_valid = (sscanf(buf, "-MSSTM: %x", &ticks) == 1);
+	geo->msstm = geo->msstm_valid ? ticks : 0;
+	hist_add(HIST_SERVICE, -1, geo->msstm_valid);
+
+	geo->fetched = time(NULL);
+	geo_save(geo);
+	return 0;
+}
+
+void print_geo(const struct geo_cache* geo){
+	int64_t ms;
+	rec_int("GEO_VALID", geo->geo_valid);
+	if(geo->geo_valid){
+		rec_float("GEO_LAT", geo->lat, 4);
+		rec_float("GEO_LON", geo->lon, 4);
+		rec_int("GEO_FIX_TIME", iridium_to_unix_ms(geo->geo_ticks) / 1000);
+	}
+	rec_int("IRIDIUM_TIME_VALID", geo->msstm_valid);
+	if(geo->msstm_valid){
+		ms = iridium_to_unix_ms(geo->msstm);
+		rec_float("IRIDIUM_TIME", ms / 1000.0, 3);
+		// how far the local clock was off when we asked.
+		rec_int("CLOCK_OFFSET", ms / 1000 - geo->fetched);
+	}
+	rec_int("GEO_AGE", time(NULL) - geo->fetched);
+}
+
+// Front-end functions
+// Signal history and pass prediction
+//  Every RSSI sample, -MSSTM service check and SBDIX outcome goes into
+//  HISTORY_FILE, a fixed-size ring mapped straight into memory so adding one
+//  is a store and nothing is ever rewritten.  Iridium coverage at a fixed
+//  site repeats and terrain blocks the same parts of the sky, so the
+//  predictor bins sessions by UTC time of day and by the RSSI read before
+//  them.  The chance a session works now is the pooled success rate of
+//  sessions in this bin and sessions at this RSSI, starting from 1 in 2.
+//  A bin's expected RSSI is the mean of its samples, with no-service reports
+//  counting as 0.
+static struct hist_ring* hist;
+
+// map HISTORY_FILE, creating or resetting it if it isn't a ring of ours.
+// returns 0 or -1.
+static int hist_map(void){
+	struct stat st;
+	void* map;
+	int fd;
+	if(hist) return 0;
+	fd = open(HISTORY_FILE, O_RDWR | O_CREAT, 0644);
+	if(fd == -1) return -1;
+	if(fstat(fd, &st) || ((st.st_size != sizeof(*hist)) && ftruncate(fd, sizeof(*hist)))){
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sizeof(*hist), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	hist = map;
+	if(memcmp(hist->magic, HISTORY_MAGIC, 4) || (hist->version != HISTORY_VERSION) ||
+		(hist->head >= HISTORY_SLOTS) || (hist->count > HISTORY_SLOTS)){
+		bzero(hist, sizeof(*hist));
+		memcpy(hist->magic, HISTORY_MAGIC, 4);
+		hist->version = HISTORY_VERSION;
+	}
+	return 0;
+}
+
+static int hist_bin(time_t t){
+	return (t % 86400) / (86400 / HIST_BINS);
+}
+
+// newest RSSI sample no older than HIST_FRESH seconds before when, or -1.
+static int hist_last_rssi(time_t when){
+	struct hist_entry* e;
+	uint32_t i;
+	if(hist_map()) return -1;
+	for(i = 1; i <= hist->count; i++){
+		e = &hist->e[(hist->head + HISTORY_SLOTS - i) % HISTORY_SLOTS];
+		if(e->time + HIST_FRESH < when) break;
+		if((e->kind == HIST_RSSI) && (e->time <= when)) return e->rssi;
+	}
+	return -1;
+}
+
+// log one sample.  Sessions are tagged with the RSSI read just before them.
+void hist_add(int kind, int rssi, int status){
+	struct hist_entry* e;
+	time_t now = time(NULL);
+	if((replay_fd != -1) || hist_map()) return; // a replay isn't today's sky.
+	if(kind == HIST_SESSION) rssi = hist_last_rssi(now);
+	e = &hist->e[hist->head];
+	e->time = now;
+	e->kind = kind;
+	e->rssi = rssi;
+	e->status = status;
+	hist->head = (hist->head + 1) % HISTORY_SLOTS;
+	if(hist->count < HISTORY_SLOTS) hist->count++;
+}
+
+// session and RSSI tallies over the whole ring.
+struct hist_tally {
+	int bin_ok[HIST_BINS], bin_n[HIST_BINS];
+	int bin_rssi_sum[HIST_BINS], bin_rssi_n[HIST_BINS];
+	int rssi_ok[RSSI_FULL + 1], rssi_n[RSSI_FULL + 1];
+	int sessions, samples;
+};
+
+static void hist_count(struct hist_tally* t){
+	struct hist_entry* e;
+	uint32_t i;
+	int b, ok;
+	time_t now = time(NULL);
+	bzero(t, sizeof(*t));
+	if(hist_map()) return;
+	for(i = 0; i < hist->count; i++){
+		e = &hist->e[i];
+		if(e->time + HIST_MAX_AGE < now) continue;
+		b = hist_bin(e->time);
+		t->samples++;
+		switch(e->kind){
+			case HIST_RSSI:
+				if((e->rssi < RSSI_BAD) || (e->rssi > RSSI_FULL)) break;
+				t->bin_rssi_sum[b] += e->rssi;
+				t->bin_rssi_n[b]++;
+				break;
+			case HIST_SERVICE:
+				if(e->status) break;
+				t->bin_rssi_n[b]++;
+				break;
+			case HIST_SESSION:
+				// MO status 0-4 is a message through.
+				ok = (e->status >= 0) && (e->status <= 4);
+				t->sessions++;
+				t->bin_ok[b] += ok;
+				t->bin_n[b]++;
+				if((e->rssi >= RSSI_BAD) && (e->rssi <= RSSI_FULL)){
+					t->rssi_ok[e->rssi] += ok;
+					t->rssi_n[e->rssi]++;
+				}
+				break;
+		}
+	}
+}
+
+static double hist_p(const struct hist_tally* t, int bin, int rssi){
+	int ok = t->bin_ok[bin] + 1, n = t->bin_n[bin] + 2;
+	// no fresh reading, go by what this bin usually sees.
+	if((rssi < RSSI_BAD) && t->bin_rssi_n[bin])
+		rssi = (t->bin_rssi_sum[bin] * 2 + t->bin_rssi_n[bin]) / (t->bin_rssi_n[bin] * 2);
+	if((rssi >= RSSI_BAD) && (rssi <= RSSI_FULL)){
+		ok += t->rssi_ok[rssi];
+		n += t->rssi_n[rssi];
+	}
+	return (double)ok / n;
+}
+
+// chance a session at when succeeds, given rssi (-1 if unknown).
+double hist_predict(time_t when, int rssi){
+	struct hist_tally t;
+	hist_count(&t);
+	return hist_p(&t, hist_bin(when), rssi);
+}
+
+// start of the next window, from now, whose sessions should succeed with at
+//  least min_p, looking a day ahead.  Puts that probability in p.
+// returns the window's unix time, or -1 if no bin we know of is that good.
+time_t hist_next_window(time_t now, double min_p, double* p){
+	struct hist_tally t;
+	time_t start;
+	int s, b, rssi = hist_last_rssi(now);
+
+	hist_count(&t);
+	for(s = 0; s < HIST_BINS; s++){
+		start = (s == 0) ? now : (now - now % (86400 / HIST_BINS) + s * (86400 / HIST_BINS));
+		b = hist_bin(start);
+		if(!t.bin_n[b] && !t.bin_rssi_n[b] && (s || (rssi < RSSI_BAD))) continue;
+		*p = hist_p(&t, b, s ? -1 : rssi);
+		if(*p >= min_p) return start;
+	}
+	*p = 0;
+	return -1;
+}
+
+// -H: what the history says about now and the next good window.
+void print_prediction(double min_p){
+	struct hist_tally t;
+	time_t now = time(NULL), window;
+	int rssi = hist_last_rssi(now);
+	double p;
+
+	hist_count(&t);
+	rec_int("HISTORY_SAMPLES", t.samples);
+	rec_int("HISTORY_SESSIONS", t.sessions);
+	rec_int("BIN_SESSIONS", t.bin_n[hist_bin(now)]);
+	rec_int("RSSI", rssi);
+	rec_float("SUCCESS_P", hist_p(&t, hist_bin(now), rssi), 2);
+	window = hist_next_window(now, min_p, &p);
+	rec_int("NEXT_WINDOW", window);
+	rec_int("NEXT_WINDOW_IN", (window == -1) ? -1 : (window - now));
+	rec_float("NEXT_WINDOW_P", p, 2);
+}
+
+// -W: read the signal and say whether a session is worth trying now.
+//  Always yes until the history has HIST_MIN_SESSIONS to go on.
+static int session_likely(struct sbd_opts* opts){
+	struct hist_tally t;
+	double p;
+	int rssi;
+	if(opts->min_p <= 0) return 1;
+	rssi = get_rssi(opts->fd);
+	hist_count(&t);
+	p = hist_p(&t, hist_bin(time(NULL)), rssi);
+	rec_float("SUCCESS_P", p, 2);
+	if((t.sessions < HIST_MIN_SESSIONS) || (p >= opts->min_p)) return 1;
+	rec_int("SESSION_SKIPPED", 1);
+	return 0;
+}
+
+// Shared status board
+//  Local services that only want to know whether there's signal, whether
+//  a message is waiting and how the last session went shouldn't have to
+//  take the port from a session to ask.  Whoever holds the port publishes
+//  the last RSSI, +SBDSX and +SBDIX it parsed in the BOARD_NAME shared
+//  memory segment, under a seqlock.  Readers map it once and then poll it
+//  with plain loads, and -b prints it without touching the port.
+static struct sbd_board* board;
+
+static int64_t unix_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// map the board read/write, creating it or resetting it if it's from
+//  another version.
+// returns 0 or -1.
+static int board_map(void){
+	struct stat st;
+	void* map;
+	int fd;
+	if(board) return 0;
+	fd = shm_open(BOARD_NAME, O_RDWR | O_CREAT, 0644);
+	if(fd == -1) return -1;
+	fchmod(fd, 0644); // readers needn't share our umask.
+	if(fstat(fd, &st) || ((st.st_size != sizeof(*board)) && ftruncate(fd, sizeof(*board)))){
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sizeof(*board), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	board = map;
+	if((board->magic != BOARD_MAGIC) || (board->version != BOARD_VERSION)){
+		bzero(board, sizeof(*board));
+		board->magic = BOARD_MAGIC;
+		board->version = BOARD_VERSION;
+	}
+	return 0;
+}
+
+// start an update.  Only the port holder writes, so there's one writer at a
+//  time.  seq goes odd even if a writer died leaving it odd.
+// returns the board, or NULL if there isn't one to write.
+static struct sbd_board* board_begin(void){
+	if((replay_fd != -1) || board_map()) return NULL;
+	__atomic_store_n(&board->seq, (board->seq + 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return board;
+}
+
+static void board_end(void){
+	board->pid = getpid();
+	board->updated_ms = unix_ms();
+	__atomic_store_n(&board->seq, board->seq + 1, __ATOMIC_RELEASE);
+}
+
+void board_rssi(int rssi){
+	struct sbd_board* b = board_begin();
+	if(!b) return;
+	b->rssi = rssi;
+	b->rssi_ms = unix_ms();
+	board_end();
+}
+
+void board_sbdsx(const int* f){
+	struct sbd_board* b = board_begin();
+	if(!b) return;
+	memcpy(b->sbdsx, f, sizeof(b->sbdsx));
+	b->sbdsx_ms = unix_ms();
+	board_end();
+}
+
+void board_sbdix(const int* r){
+	struct sbd_board* b = board_begin();
+	if(!b) return;
+	memcpy(b->sbdix, r, sizeof(b->sbdix));
+	b->sbdix_ms = unix_ms();
+	board_end();
+}
+
+void board_agent(int pending){
+	struct sbd_board* b = board_begin();
+	if(!b) return;
+	b->agent_pending = pending;
+	b->agent_ms = unix_ms();
+	board_end();
+}
+
+// a consistent copy of the board.  Maps it read-only the first time, after
+//  that it's loads and a copy.
+// returns 0, or -1 if there's no board or its writer died mid-update.
+int board_read(struct sbd_board* out){
+	static const struct sbd_board* ro;
+	struct stat st;
+	uint32_t seq;
+	void* map;
+	int fd, tries;
+
+	if(!ro){
+		fd = shm_open(BOARD_NAME, O_RDONLY, 0);
+		if(fd == -1) return -1;
+		// a writer between shm_open() and ftruncate() has left it empty,
+		//  and touching a page past the end is a SIGBUS.
+		if(fstat(fd, &st) || (st.st_size < sizeof(*ro))){
+			close(fd);
+			errno = ENODATA;
+			return -1;
+		}
+		map = mmap(NULL, sizeof(*ro), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) return -1;
+		ro = map;
+	}
+	for(tries = 0; tries < BOARD_READ_TRIES; tries++){
+		seq = __atomic_load_n(&ro->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1) continue;
+		memcpy(out, (const void*)ro, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&ro->seq, __ATOMIC_RELAXED) != seq) continue;
+		if((out->magic != BOARD_MAGIC) || (out->version != BOARD_VERSION)){
+			errno = EPROTO;
+			return -1;
+		}
+		return 0;
+	}
+	errno = EBUSY;
+	return -1;
+}
+
+// -b: the board under the same keys -r, -s and -c use.
+// returns 0 or -1.
+int print_board(void){
+	struct sbd_board b;
+	if(board_read(&b)){
+		rec_text("BOARD_ERROR", (errno == ENOENT) ? "nothing has published yet" : strerror(errno));
+		return -1;
+	}
+	rec_int("BOARD_UPDATED_MS", b.updated_ms);
+	rec_int("BOARD_PID", b.pid);
+	rec_int("RSSI", b.rssi);
+	rec_int("RSSI_MS", b.rssi_ms);
+	rec_int("MSG_OUT_WAIT", b.sbdsx[0]);
+	rec_int("MSG_OUT_SEQ_NUM", b.sbdsx[1]);
+	rec_int("MSG_IN_WAIT", b.sbdsx[2]);
+	rec_int("MSG_IN_SEQ_NUM", b.sbdsx[3]);
+	rec_int("RING_ALERT", b.sbdsx[4]);
+	rec_int("MESSAGES_ON_SERVER", b.sbdsx[5]);
+	rec_int("SBDSX_MS", b.sbdsx_ms);
+	rec_int("MO_STATUS", b.sbdix[0]);
+	rec_int("MO_SEQ_NUM", b.sbdix[1]);
+	rec_int("MT_STATUS", b.sbdix[2]);
+	rec_int("MT_SEQ_NUM", b.sbdix[3]);
+	rec_int("MT_LENGTH", b.sbdix[4]);
+	rec_int("MT_QUEUED", b.sbdix[5]);
+	rec_int("SBDIX_MS", b.sbdix_ms);
+	rec_int("AGENT_REPLY_BYTES_PENDING", b.agent_pending);
+	rec_int("AGENT_MS", b.agent_ms);
+	return 0;
+}
+
 // info() spits out a bunch of modem-related information.
 //  It also attempts to connect to the SBD network.
-static void info(int fd){
-	int error, moflag,momsn,mtflag,mtmsn,raflag,waitcount;
-	int x,y,z,geotimestamp;
+// returns 0, or -1 if any query went unanswered.
+int info(int fd){
+	int error = 0;
+	int rssi;
+	int f[SBDSX_FIELDS];
+	struct geo_cache geo;
 	unsigned char buf[MAX_BUFF] = {'\0'};
+	char raw[80];
 	// MODEM_FIRMWARE=   ... ati3
-	imu_rw("ati3\r\n", buf, fd);
-	fprintf(stderr, "MODEM_FIRMWARE=%s\n", buf); 
+	if(imu_rw("ati3\r\n", buf, fd) < 0) error = -1;
+	rec_str("MODEM_FIRMWARE", buf); 
 	// MODEM_HARDWARE="..."  ati4
-	imu_rw("ati4\r\n", buf, fd);
-	fprintf(stderr, "MODEM_HARDWARE=%s\n", buf);
+	if(imu_rw("ati4\r\n", buf, fd) < 0) error = -1;
+	rec_str("MODEM_HARDWARE", buf);
 	// MODEM_HW_INFO="..."  ati7
-	imu_rw("ati7\r\n", buf, fd);
-	fprintf(stderr, "MODEM_HW_INFO=%s\n", buf);
+	if(imu_rw("ati7\r\n", buf, fd) < 0) error = -1;
+	rec_str("MODEM_HW_INFO", buf);
 	// IMEI=... 	at+gsn
-	imu_rw("at+gsn\r\n", buf, fd);
-	fprintf(stderr, "IMEI=%s\n", buf);
+	if(imu_rw("at+gsn\r\n", buf, fd) < 0) error = -1;
+	rec_str("IMEI", buf);
 	// RSSI=...     at+csq
-	fprintf(stderr, "RSSI=%d\n", get_rssi(fd));
+	rssi = get_rssi(fd);
+	if(rssi < 0) error = -1;
+	rec_int("RSSI", (rssi < 0) ? 0 : rssi);
 	// GW_TYPE=... EMSS or NON-EMSS. 	at+sbdgw
-	imu_rw("at+sbdgw\r\n", buf, fd);
+	if(imu_rw("at+sbdgw\r\n", buf, fd) < 0) error = -1;
 	sscanf(buf, "+SBDGW: %s", buf);
-	fprintf(stderr, "GW_TYPE=%s\n", buf);
-	// MSGEO=... Geolocation String x,y,z,timestamp. 	at-msgeo
-	imu_rw("at-msgeo\r\n", buf, fd);
-	sscanf(buf, "-MSGEO:%d,%d,%d,%x", &x, &y, &z, &geotimestamp);
-	fprintf(stderr, "RAW_MSGEO=%d,%d,%d,0x%x\n", x,y,z,geotimestamp);
-	// MSSTM=... <iridium system time in secs from iridium epoch>	at-msstm
-	imu_rw("at-msstm\r\n", buf, fd);
-	sscanf(buf, "-MSSTM: %x", buf); // msstm should really be expressed as an integer.
-	fprintf(stderr, "MSSTM=0x%x\n", buf);
+	rec_str("GW_TYPE", buf);
+	// MSGEO and MSSTM, also refreshes the geo cache.
+	geo_load(&geo);
+	if(geo_refresh(fd, &geo)) error = -1;
+	sprintf(raw, "%d,%d,%d,0x%x", geo.x, geo.y, geo.z, geo.geo_ticks);
+	rec_str("RAW_MSGEO", raw);
+	sprintf(raw, "0x%x", geo.msstm);
+	rec_str("MSSTM", raw);
+	print_geo(&geo);
 	// SBDS -- Will need to parse this output.  This is how we tell if there's a message
 	//  ready to receive.    at+sbds
-	imu_rw("at+sbdsx\r\n", buf, fd);
-	sscanf(buf, "+SBDSX:%d, %d, %d, %d, %d, %d", &moflag, &momsn, &mtflag, &mtmsn, &raflag, &waitcount);
-	fprintf(stderr, "RAW_SBDSX=%d,%d,%d,%d,%d,%d\n", moflag, momsn, mtflag, mtmsn, raflag, waitcount);
-	fprintf(stderr, "INBOX_STATUS=%d\n", mtflag);
-	fprintf(stderr, "OUTBOX_PENDING=%d\n", moflag);
-	fprintf(stderr, "SERVER_MSG_PENDING=%d\n", waitcount);
+	bzero(f, sizeof(f));
+	if(imu_rw("at+sbdsx\r\n", buf, fd) < 0) error = -1;
+	if(sscanf(buf, "+SBDSX:%d, %d, %d, %d, %d, %d", &f[0], &f[1], &f[2], &f[3], &f[4],
+		&f[5]) == SBDSX_FIELDS)
+		board_sbdsx(f);
+	sprintf(raw, "%d,%d,%d,%d,%d,%d", f[0], f[1], f[2], f[3], f[4], f[5]);
+	rec_str("RAW_SBDSX", raw);
+	rec_int("INBOX_STATUS", f[2]);
+	rec_int("OUTBOX_PENDING", f[0]);
+	rec_int("SERVER_MSG_PENDING", f[5]);
+	return error;
 }
 
 //  send at+sbdwt, wait for READY, dump message text into modem.
-// returns 0 or err status.
+// returns bytes written, or -1 on error.
 int send_text_message(char* themessage, int length, int fd){
 	unsigned char temp_buff[MAX_BUFF] = {'\0'};
 	unsigned char sendCmd[] = "at+sbdwt\r\n";
-	unsigned int len = -1;
+	int len = -1;
+	int attempt, fault;
 
 	if(length > 340){
-		fprintf(stderr, "Specified length larger than outbound buffer.  Aborting.\n");
-		abort();
+		fprintf(stderr, "Specified length larger than outbound buffer.\n");
+		return -1;
 	}
 	
-	write_to_imu(sendCmd, strlen(sendCmd), fd);
-	read_from_imu(temp_buff, fd);
+	for(attempt = 0; attempt < RETRY_MAX; attempt++){
+		len = imu_rw(sendCmd, temp_buff, fd);
+		if(len < 0) return -1;
 
-	if(temp_buff[0] == 'E') ; // fail case. XXX handle error.
-
-	len = write_to_imu(themessage, length, fd);
-	len += write_to_imu("\r", 1, fd);  // text message must be terminated by a carriage return.
-	return len;
+		fault = FAULT_NONE;
+		if(temp_buff[0] != 'R') fault = FAULT_DESYNC; // not READY.
+		else {
+			len = write_to_imu(themessage, length, fd);
+			len += write_to_imu("\r", 1, fd);  // text message must be terminated by a carriage return.
+			// modem answers 0 ok, 1 timeout.
+			if(len != length + 1) fault = FAULT_IO;
+			else if(read_from_imu(temp_buff, fd) < 0)
+				fault = (errno == ETIMEDOUT) ? FAULT_TIMEOUT : FAULT_DESYNC;
+			else switch(temp_buff[0]){
+				case '0': return len;
+				case '1': fault = FAULT_TIMEOUT; break;
+				default:  fault = FAULT_DESYNC;
+			}
+		}
+		if(imu_recover(fd, fault, attempt)) break;
+	}
+	return -1;
 }
 
 // takes buf, sets len and checksum, puts into MO buf on modem.
-// returns total number of message bytes written.
+// returns total number of message bytes written, or -1 on error.
 //  sbdwb format:  at+sbdwb=<binary len>. modem responds READY
 //    Then send <binary> + <2 byte checksum>.
+//    Modem answers 0 ok, 1 timeout, 2 checksum mismatch, 3 size wrong.
 int send_binary_data(char* buf, int fd, int len){
-	unsigned int i, calc_checksum, len2;
+	unsigned int i, calc_checksum;
+	int len2, attempt, fault;
 	uint16_t trunc_checksum;
 	unsigned char checksum[2];
 	unsigned char sendCmd[MAX_BUFF] = { '\0' };
@@ -360,23 +2034,40 @@ int send_binary_data(char* buf, int fd, int len){
 	if(MAX_BUFF <= len + 2){
 		// fail loudly here.  len should be at most max_buff minus 2.
 		fprintf(stderr, "ERROR=len %d > %d\n", len, (MAX_BUFF-2));
-		abort();
+		return -1;
 	}
-	// Insert len and checksum.
-	for(i = 0; i < len ; i++) calc_checksum += buf[i];
+	// Insert len and checksum.  Modem sums the bytes unsigned.
+	calc_checksum = 0;
+	for(i = 0; i < len ; i++) calc_checksum += (unsigned char)buf[i];
 	trunc_checksum = calc_checksum;
 	checksum[0] = trunc_checksum >> 8;
 	checksum[1] = trunc_checksum;
 
-	len2 = write_to_imu(sendCmd, strlen(sendCmd), fd);
-	i = read_from_imu(temp_buff, fd);
-	if (temp_buff[0] == 'E') abort(); // XXX Handle error?
-	else if (temp_buff[0] != 'R')  fprintf(stderr, "WRITE_ERROR=\"%s\"\n", temp_buff); // XXX not R not E should not happen.
+	for(attempt = 0; attempt < RETRY_MAX; attempt++){
+		if(imu_rw(sendCmd, temp_buff, fd) < 0) return -1;
 
-	len2 = write_to_imu(buf, len, fd); // binary message.
-	len2 += write_to_imu(checksum, 2, fd);   // checksum.
-
-	return len2;
+		fault = FAULT_NONE;
+		if (temp_buff[0] != 'R'){
+			rec_text("WRITE_ERROR", temp_buff);
+			fault = FAULT_DESYNC;
+		}
+		else {
+			len2 = write_to_imu(buf, len, fd); // binary message.
+			len2 += write_to_imu(checksum, 2, fd);   // checksum.
+			if(len2 != len + 2) fault = FAULT_IO;
+			else if(read_from_imu(temp_buff, fd) < 0)
+				fault = (errno == ETIMEDOUT) ? FAULT_TIMEOUT : FAULT_DESYNC;
+			else switch(temp_buff[0]){
+				case '0': return len2;
+				case '1': fault = FAULT_TIMEOUT; break;
+				case '2': fault = FAULT_CHECKSUM; break;
+				case '3': fault = FAULT_SIZE; break;
+				default:  fault = FAULT_DESYNC;
+			}
+		}
+		if(imu_recover(fd, fault, attempt)) break;
+	}
+	return -1;
 }
 
 //  read text data from MT buffer on modem.
@@ -386,6 +2077,7 @@ int send_binary_data(char* buf, int fd, int len){
 int get_text_data(char* buf, int fd){
 	int i;
 	int len = imu_rw("at+sbdrt\r\n", buf, fd);
+	if(len < 7) return -1; // no reply, or too short to hold "+sbdrt:".
 	// strip +sbdrt:\r from buf.
 	for(i=0; i<(len-6); i++)
 		buf[i]=buf[i+7];
@@ -399,21 +2091,48 @@ int get_text_data(char* buf, int fd){
 int print_text_data(int fd){
 	unsigned char buf[MAX_BUFF] = { '\0' };
 	int len = get_text_data(buf, fd);
-	fprintf(stderr, "TEXT_MESSAGE=\"%s\"\n", buf);
+	if(len < 0) return -1;
+	rec_text("TEXT_MESSAGE", buf);
+	return 0;
 }
 
 //  Sends raw binary data from char* buf to stdout.
 //  Intended for use with a binary read utility such as
 //  hexdump.
+//  In JSON/CBOR output it goes in the record instead.
 void print_binary_data(char* buf, int len){
-	// XXX
-	write(STDOUT_FILENO, buf, len);
+	rec_bytes("DATA", buf, len);
 }
 
-void dread(int fd){
-	unsigned char buf[MAX_BUFF];
+// read the MT buffer into buf, opening the envelope if a key is loaded.
+// returns payload length without the checksum, which is left after it
+//  when there's no envelope, or -1.
+static int read_payload(int fd, unsigned char* buf){
+	unsigned char opened[MAX_BUFF];
+	int len;
 	bzero(buf, sizeof(char)*MAX_BUFF);
-	print_binary_data(buf, read_binary_from_imu(buf, fd));
+	len = read_binary_from_imu(buf, fd);
+	if(len < 2) return -1;
+	if(!aead_on) return len - 2;
+	len = envelope_open(opened, buf, len - 2);
+	if(len < 0){
+		rec_text("ENVELOPE_ERROR", "not authentic");
+		return -1;
+	}
+	memcpy(buf, opened, len);
+	return len;
+}
+
+//  With a key loaded only the opened payload is printed, without checksum.
+// returns 0 or -1.
+int dread(int fd){
+	unsigned char buf[MAX_BUFF];
+	int len = read_payload(fd, buf);
+	if(len < 0) return -1;
+	// text mode has always passed the checksum through, records carry only the payload.
+	if((out_format == FMT_TEXT) && !aead_on) len += 2;
+	print_binary_data(buf, len);
+	return 0;
 }
 
 // int clearbufs(instruction, *fd)	
@@ -422,27 +2141,29 @@ void dread(int fd){
 // 1=clear MT
 // 2=clear both
 // returns 0: clear successful
-// returns 1: error while clearing buffer.
+// returns 1: error while clearing buffer, or no answer.
 // modem return format:
 // 0<cr><lf><cr><lf><OK><cr><lf>
 int clearbufs(int instruction, int fd){
 	int bytes = 0;
-	unsigned char buf[MAX_BUFF]; 
+	int len = -1;
+	unsigned char buf[MAX_BUFF] = { '\0' };
 	switch(instruction){
 		case 0:
-			imu_rw("at+sbdd0\r\n", buf, fd);
+			len = imu_rw("at+sbdd0\r\n", buf, fd);
 			break;
 		case 1:
-			imu_rw("at+sbdd1\r\n", buf, fd);
+			len = imu_rw("at+sbdd1\r\n", buf, fd);
 			break;
 		case 2:
-			imu_rw("at+sbdd2\r\n", buf, fd);
+			len = imu_rw("at+sbdd2\r\n", buf, fd);
 	}
+	if(len < 0) return 1;
 	sscanf(buf, "%d", &bytes);
 	return bytes;
 }
 
-void getsbdstatus(int fd){
+int getsbdstatus(int fd){
 	// at+sbdsx
 	// modem returns "+SBDSX: mflag, momsn, mtflag, mtmsn, raflag, msg_wait"
 	//   mtmsn will be -1 if no message pending send.
@@ -452,26 +2173,45 @@ void getsbdstatus(int fd){
 	//   momsn is outbound, mtmsn is inbound.
 	//   raflag is ring alert (not really needed on 9602).
 	//   msg_wait is how many inbound messages are queued in the cloud.
-	int mflag, momsn, mtflag, mtmsn, raflag, msg_wait;
+	int f[SBDSX_FIELDS] = { 0 };
 	unsigned char buf[MAX_BUFF] = { '\0' };
-	mflag = momsn = mtflag = mtmsn = raflag = msg_wait = 0;
-	imu_rw("at+sbdsx\r\n", buf, fd);
-	sscanf(buf, "+SBDSX: %d, %d, %d, %d, %d, %d\n", &mflag, &momsn, &mtflag, &mtmsn,
-		&raflag, &msg_wait);
-	fprintf(stderr, "MSG_OUT_WAIT=%d\n", mflag);
-	fprintf(stderr, "MSG_OUT_SEQ_NUM=%d\n", momsn);
-	fprintf(stderr, "MSG_IN_WAIT=%d\n", mtflag);
-	fprintf(stderr, "MSG_IN_SEQ_NUM=%d\n", mtmsn);
-	fprintf(stderr, "RING_ALERT=%d\n", raflag);
-	fprintf(stderr, "MESSAGES_ON_SERVER=%d\n", msg_wait);
-}
-
-void getsbdrssi(int fd){
-	unsigned char buf[MAX_BUFF];
-	int rssi = 0;
-	imu_rw(RSSI_QUERY, buf, fd);
-	sscanf(buf, "%d", &rssi);
-	fprintf(stderr, "RSSI=%d\n", rssi);
+	int len;
+	len = imu_rw("at+sbdsx\r\n", buf, fd);
+	if(sscanf(buf, "+SBDSX: %d, %d, %d, %d, %d, %d\n", &f[0], &f[1], &f[2], &f[3],
+		&f[4], &f[5]) == SBDSX_FIELDS)
+		board_sbdsx(f);
+	rec_int("MSG_OUT_WAIT", f[0]);
+	rec_int("MSG_OUT_SEQ_NUM", f[1]);
+	rec_int("MSG_IN_WAIT", f[2]);
+	rec_int("MSG_IN_SEQ_NUM", f[3]);
+	rec_int("RING_ALERT", f[4]);
+	rec_int("MESSAGES_ON_SERVER", f[5]);
+	return (len < 0) ? -1 : 0;
+}
+
+// at+sbdsx into f, without reporting it.
+// returns 0 or -1.
+static int get_sbdsx(int fd, int* f){
+	unsigned char buf[MAX_BUFF] = { '\0' };
+	if(imu_rw("at+sbdsx\r\n", buf, fd) < 0) return -1;
+	if(sscanf(buf, "+SBDSX: %d, %d, %d, %d, %d, %d", &f[0], &f[1], &f[2], &f[3],
+		&f[4], &f[5]) != SBDSX_FIELDS) return -1;
+	board_sbdsx(f);
+	return 0;
+}
+
+// MOMSN the next MO message will go out under, from at+sbdsx.
+// returns it, or -1.
+static int get_momsn(int fd){
+	int f[SBDSX_FIELDS];
+	if(get_sbdsx(fd, f)) return -1;
+	return f[1];
+}
+
+int getsbdrssi(int fd){
+	int rssi = get_rssi(fd);
+	rec_int("RSSI", (rssi < 0) ? 0 : rssi);
+	return (rssi < 0) ? -1 : 0;
 }
 
 
@@ -486,49 +2226,615 @@ int setup_modem(int fd){
 	return error;
 }
 
+// after a timed-out read, keep waiting for the reply up to cmd_class's ceiling.
+// returns 1 if something arrived, else 0.
+static int late_reply(int fd, int cmd_class){
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int64_t wait_ms;
+	if(replay_fd != -1) return 0;
+	wait_ms = latency_limits[cmd_class][2] - (int64_t)(now_us() - pending_sent_us) / 1000;
+	if(wait_ms <= 0) return 0;
+	return poll(&pfd, 1, wait_ms) > 0;
+}
+
+// at+sbdix.  Fills r with MO status, MOMSN, MT status, MTMSN, MT length and
+//  MT queued.
+//  Unlike imu_rw() this only resends after an ERROR.  Once the command is out
+//  a session may be running, and another at+sbdix would start a second one.
+//  If the reply is lost, at+sbdsx tells whether the MOMSN moved on: if it
+//  did the session went through and r is filled in from there, with MT
+//  status 2 since what came down is unknown.
+// returns MO status, or -1 if the modem didn't answer.
+static int sbdix(int fd, int* r){
+	unsigned char buf[MAX_BUFF];
+	struct geo_cache geo;
+	int f[SBDSX_FIELDS];
+	int len, fault, attempt;
+	int lost = 0;
+	int momsn = get_momsn(fd);
+
+	for(attempt = 0; attempt < RETRY_MAX; attempt++){
+		bzero(buf, MAX_BUFF);
+		if(write_to_imu("at+sbdix\r\n", strlen("at+sbdix\r\n"), fd) < 0)
+			fault = FAULT_IO;
+		else {
+			len = read_from_imu(buf, fd);
+			if((len < 0) && (errno == ETIMEDOUT) && late_reply(fd, CMD_SESSION))
+				len = read_from_imu(buf, fd);
+			fault = imu_fault(len, buf);
+			if(fault == FAULT_NONE) break;
+			if(fault != FAULT_ERROR) lost = 1;
+		}
+		if(imu_recover(fd, fault, attempt)) return -1;
+		if(lost) break;
+	}
+	if(attempt == RETRY_MAX) return -1;
+	if(lost){
+		bzero(buf, MAX_BUFF);
+		if((momsn < 0) || (imu_rw("at+sbdsx\r\n", buf, fd) < 0)) return -1;
+		if(sscanf(buf, "+SBDSX: %d, %d, %d, %d, %d, %d", &f[0], &f[1], &f[2], &f[3],
+			&f[4], &f[5]) != SBDSX_FIELDS) return -1;
+		board_sbdsx(f);
+		if(f[1] == momsn) return -1;
+		sprintf(buf, "+SBDIX: 0, %d, 2, %d, 0, %d", momsn, f[3], f[5]);
+	}
+	if(sscanf(buf, "+SBDIX:%d,%d,%d,%d,%d,%d", &r[0], &r[1], &r[2], &r[3], &r[4],
+		&r[5]) != SBDIX_FIELDS) return -1;
+	hist_add(HIST_SESSION, -1, r[0]);
+	board_sbdix(r);
+
+	// MO status 0-4 means the session got through, so MSGEO/MSSTM are fresh.
+	if((r[0] >= 0) && (r[0] <= 4)){
+		geo_load(&geo);
+		if(time(NULL) - geo.fetched >= GEO_REFRESH_AGE)
+			geo_refresh(fd, &geo);
+	}
+	return r[0];
+}
+
 // int sbdopensession(int fd)
 //  Takes file descriptor of modem serial port.
 //  Prints modem return data to stderr.
 //  Returns MO Session Status value.
 int sbdopensession(int fd){
-	// at+sbdix
-	unsigned char buf[MAX_BUFF];
-	int len = -1;
-	int mostat,momsn,mtstat,mtmsn,mtlen,mtqueued;
-	bzero(buf, MAX_BUFF);
-	len = imu_rw("at+sbdix\r\n", buf, fd); // XXX Could do with a local error check here.
-	sscanf(buf, "+SBDIX:%d,%d,%d,%d,%d,%d", &mostat, &momsn, &mtstat, &mtmsn, &mtlen, 
-		&mtqueued);
-	fprintf(stderr, 
-		"MO_STATUS=%d\n"
-		"MO_SEQ_NUM=%d\n"
-		"MT_STATUS=%d\n"
-		"MT_SEQ_NUM=%d\n"
-		"MT_LENGTH=%d\n"
-		"MT_QUEUED=%d\n", mostat, momsn, mtstat, mtmsn, mtlen, mtqueued);
+	int r[SBDIX_FIELDS];
+	int mostat = sbdix(fd, r);
+	if(mostat < 0) return -1; // modem didn't come back, nothing to report.
+	rec_int("MO_STATUS", r[0]);
+	rec_int("MO_SEQ_NUM", r[1]);
+	rec_int("MT_STATUS", r[2]);
+	rec_int("MT_SEQ_NUM", r[3]);
+	rec_int("MT_LENGTH", r[4]);
+	rec_int("MT_QUEUED", r[5]);
 	return mostat;
 }
 
+// how long stdin gets to deliver a payload, or -1 to wait forever.
+//  Under -S stdin is a client's, and one that's slow to write mustn't hold
+//  the port from everyone else.
+static int input_deadline_ms = -1;
+
+// read len bytes of stdin into buf, fewer if it ends first.
+// returns bytes read, or -1 on error or if input_deadline_ms runs out.
+static int read_input(unsigned char* buf, int len){
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	uint64_t end = now_us() + (uint64_t)input_deadline_ms * 1000;
+	int64_t wait_ms;
+	int got = 0, more;
+
+	while(got < len){
+		if(input_deadline_ms >= 0){
+			wait_ms = ((int64_t)(end - now_us())) / 1000;
+			if((wait_ms <= 0) || (poll(&pfd, 1, wait_ms) <= 0)){
+				rec_text("INPUT_ERROR", "stdin stalled");
+				return -1;
+			}
+		}
+		more = read(STDIN_FILENO, &buf[got], len - got);
+		if(more < 0) return -1;
+		if(more == 0) break;
+		got += more;
+	}
+	return got;
+}
+
 // drop a text string into the MO buffer.
 int sending_text(int fd, int len){
 	int result = 0;
 	unsigned char buf[MAX_BUFF] = { '\0' };
-	result = read(STDIN_FILENO, buf, len);
-	if (result != len) ; // XXX maybe not done reading?
-	result = send_text_message(buf, len, fd);
+	result = read_input(buf, len);
+	if(result < 0) return result;
+	return send_text_message(buf, result, fd);
+}
+
+// load len bytes of buf into the MO buffer, sealed if a key is loaded.
+// returns what send_binary_data() does.
+static int send_payload(int fd, unsigned char* buf, int len){
+	unsigned char sealed[MAX_BUFF];
+	int momsn;
+	if(aead_on){
+		momsn = get_momsn(fd);
+		if(momsn < 0) return -1;
+		len = envelope_seal(sealed, buf, len, momsn);
+		if(len < 0){
+			rec_text("ENVELOPE_ERROR", "could not seal");
+			return -1;
+		}
+		buf = sealed;
+	}
+	return send_binary_data(buf, fd, len);
 }
 
 // drop a binary blob into the MO buffer.
+//  With a key loaded the blob goes in sealed, see envelope_seal().
 int sending_binary(int fd, int len){
 	int result = 0;
-	unsigned char checksum[2] = {0};
 	unsigned char buf[MAX_BUFF] = {'\0'};
-	result = read(STDIN_FILENO, buf, len);
-	// in case read returns before len.
-	if(result < len)
-		result += read(STDIN_FILENO, &buf[result], (result - len));
-	result = send_binary_data(buf, fd, result);
-	return result;
+	int room = aead_on ? (MAXBYTES - AEAD_OVERHEAD) : (MAX_BUFF - 3);
+
+	if(len > room){
+		fprintf(stderr, "ERROR=len %d > %d\n", len, room);
+		return -1;
+	}
+	result = read_input(buf, len);
+	if(result < 0) return result;
+	return send_payload(fd, buf, result);
+}
+
+// -X <ratio>: send stdin as one transfer of k data messages and ceil(k * ratio)
+//  parity messages, one session each.  A message that doesn't get through
+//  isn't resent, the receiver rebuilds the transfer from any k.  If an MT
+//  message comes down on the way, sending stops there so the next session
+//  can't overwrite it; read it with -d or -Y.
+// returns 0 if at least k messages went through, else -1.
+int fec_send(int fd, char* arg){
+	static unsigned char in[FEC_MAX_N * MAXBYTES + 1];
+	static unsigned char data[FEC_MAX_N][MAXBYTES];
+	unsigned char* shard[FEC_MAX_N];
+	unsigned char msg[MAX_BUFF];
+	int room = (aead_on ? (MAXBYTES - AEAD_OVERHEAD) : MAXBYTES) - FEC_HDR_LEN;
+	int r[SBDIX_FIELDS];
+	int i, k, n, len, size, id, rand_fd, mostat;
+	int sent = 0, lost = 0, mt_waiting = 0;
+	double ratio;
+
+	if((sscanf(arg, "%lf", &ratio) != 1) || (ratio < 0)){
+		rec_text("FEC_ERROR", "redundancy ratio must be a number >= 0");
+		return -1;
+	}
+	len = read_input(in, sizeof(in));
+	if(len < 0) return -1;
+	k = (len + room - 1) / room;
+	n = k + (int)ceil(k * ratio);
+	if(!len || (n > FEC_MAX_N)){
+		rec_text("FEC_ERROR", len ? "transfer too large for this ratio" : "nothing to send");
+		return -1;
+	}
+
+	// equal shards, the last one zero padded.
+	size = (len + k - 1) / k;
+	for(i = 0; i < n; i++){
+		shard[i] = data[i];
+		bzero(data[i], MAXBYTES);
+		if((i < k) && (i * size < len))
+			memcpy(data[i], &in[i * size], (len - i * size < size) ? (len - i * size) : size);
+	}
+	fec_encode(shard, k, n, size);
+
+	rand_fd = open("/dev/urandom", O_RDONLY);
+	if((rand_fd == -1) || (read(rand_fd, &id, sizeof(id)) != sizeof(id)))
+		id = getpid() ^ time(NULL);
+	if(rand_fd != -1) close(rand_fd);
+	id &= 0xffff;
+
+	memcpy(msg, FEC_MAGIC, 2);
+	msg[2] = id >> 8;
+	msg[3] = id;
+	msg[4] = k;
+	msg[5] = n;
+	msg[7] = len >> 8;
+	msg[8] = len;
+	for(i = 0; (i < n) && !mt_waiting; i++){
+		msg[6] = i;
+		memcpy(&msg[FEC_HDR_LEN], shard[i], size);
+		mostat = -1;
+		if(send_payload(fd, msg, FEC_HDR_LEN + size) >= 0)
+			mostat = sbdix(fd, r);
+		if((mostat >= 0) && (mostat <= 4)) sent++;
+		else lost++;
+		if((mostat >= 0) && (r[2] == 1)) mt_waiting = 1;
+	}
+	rec_int("FEC_ID", id);
+	rec_int("FEC_K", k);
+	rec_int("FEC_N", n);
+	rec_int("FEC_SHARD_BYTES", size);
+	rec_int("FEC_SENT", sent);
+	rec_int("FEC_LOST", lost);
+	rec_int("FEC_UNSENT", n - i);
+	rec_int("MT_WAITING", mt_waiting);
+	return (sent >= k) ? 0 : -1;
+}
+
+// gather transfer id's shards from the spool and, once k are in, rebuild it
+//  and emit it as DATA.  size is the shard size of the one just received.
+static int fec_assemble(int id, int k, int n, int total, int size){
+	static unsigned char data[FEC_MAX_N][MAXBYTES];
+	static unsigned char out[FEC_MAX_N * MAXBYTES];
+	unsigned char* shard[FEC_MAX_N];
+	unsigned char msg[MAX_BUFF];
+	int have[FEC_MAX_N];
+	char name[sizeof(FEC_SPOOL_DIR) + 16];
+	struct stat st;
+	int i, fd, len, count = 0;
+
+	// data and out are sized for shards of at most MAXBYTES.
+	if((size < 1) || (size > MAXBYTES)) return -1;
+	for(i = 0; i < n; i++){
+		shard[i] = data[i];
+		have[i] = 0;
+		snprintf(name, sizeof(name), FEC_SPOOL_DIR "/%04x.%d", id, i);
+		fd = open(name, O_RDONLY);
+		if(fd == -1) continue;
+		len = -1;
+		if(!fstat(fd, &st) && (time(NULL) - st.st_mtime <= FEC_SPOOL_AGE))
+			len = read(fd, msg, sizeof(msg));
+		close(fd);
+		// only shards of this same transfer count, anything else is a
+		//  leftover whose id came around again.
+		if((len > FEC_HDR_LEN + MAXBYTES) || (len != FEC_HDR_LEN + size) || (msg[4] != k) || (msg[5] != n) ||
+			(msg[6] != i) || (((msg[7] << 8) | msg[8]) != total)){
+			unlink(name);
+			continue;
+		}
+		memcpy(data[i], &msg[FEC_HDR_LEN], size);
+		have[i] = 1;
+		count++;
+	}
+	rec_int("FEC_HAVE", count);
+	if(count < k) return 0;
+	if(fec_decode(shard, have, k, n, size)) return -1;
+
+	for(i = 0; i < k; i++) memcpy(&out[i * size], data[i], size);
+	rec_bytes("DATA", out, total);
+	for(i = 0; i < n; i++){
+		snprintf(name, sizeof(name), FEC_SPOOL_DIR "/%04x.%d", id, i);
+		unlink(name);
+	}
+	return 0;
+}
+
+// take a received MT payload.  A -X shard goes to FEC_SPOOL_DIR and the
+//  transfer comes out as DATA once any k of its n are in.  Anything else
+//  comes out as DATA straight away, like -d.
+// returns 0 or -1.
+static int fec_accept(unsigned char* buf, int len){
+	char name[sizeof(FEC_SPOOL_DIR) + 16];
+	int id, k, n, index, total, size, out;
+
+	if((len <= FEC_HDR_LEN) || memcmp(buf, FEC_MAGIC, 2)){
+		print_binary_data(buf, len);
+		return 0;
+	}
+	id = (buf[2] << 8) | buf[3];
+	k = buf[4];
+	n = buf[5];
+	index = buf[6];
+	total = (buf[7] << 8) | buf[8];
+	size = len - FEC_HDR_LEN;
+	rec_int("FEC_ID", id);
+	rec_int("FEC_INDEX", index);
+	rec_int("FEC_K", k);
+	rec_int("FEC_N", n);
+	// the MT buffer holds up to 340 bytes (-a copies a whole MO message), more
+	//  than a -X shard, so size needs checking too.
+	if((k < 1) || (n < k) || (n > FEC_MAX_N) || (index >= n) || (size > MAXBYTES) ||
+		(total > k * size)){
+		rec_text("FEC_ERROR", "bad shard header");
+		return -1;
+	}
+
+	if(mkdir(FEC_SPOOL_DIR, 0700) && (errno != EEXIST)) return -1;
+	snprintf(name, sizeof(name), FEC_SPOOL_DIR "/%04x.%d", id, index);
+	out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(out == -1) return -1;
+	if(write(out, buf, len) != len){
+		close(out);
+		unlink(name);
+		return -1;
+	}
+	close(out);
+	return fec_assemble(id, k, n, total, size);
+}
+
+// -Y: read the MT buffer and hand it to fec_accept().
+int fec_receive(int fd){
+	unsigned char buf[MAX_BUFF];
+	int len = read_payload(fd, buf);
+	if(len < 0) return -1;
+	return fec_accept(buf, len);
+}
+
+// Command agent
+//  -A runs one pass of the agent: a session to pick up MT, then each
+//  command message that came down is run, and the replies go out on the
+//  next session, which the pass makes straight away.  An operator's
+//  command comes back in about one session.  Run -A from cron or a loop
+//  to poll.
+//
+//  Commands are only taken sealed (-K is required), so envelope_open()
+//  authenticates them and stops old ones being replayed.  A command
+//  message is
+//   "AC" { <opcode> <seq> <arg len> <arg> } ...
+//  Each command runs the AGENT_CONFIG handler for its opcode under
+//  /bin/sh -c, with the argument as $1.  Replies from any number of
+//  commands are packed into as few MO messages as they fit:
+//   "AR" { <opcode> <seq> <status> <out len> <out> } ...
+//  out is the first AGENT_OUT_MAX bytes the handler printed.  status is
+//  its exit status, 128 + signal if it was killed (which includes
+//  running past AGENT_TIMEOUT_MS), or AGENT_ST_UNKNOWN.  Replies wait in
+//  AGENT_QUEUE_FILE until an -A session sends them.  The agent only loads
+//  them into an empty MO buffer, and only clears it once a session has
+//  delivered what was in it, so another process's MO message is never lost.
+static char* agent_handler[256];
+
+// read <opcode> <command> lines from AGENT_CONFIG.  Without one only
+//  AGENT_OP_PING answers.
+static void agent_load_config(void){
+	char line[512];
+	char* cmd;
+	long op;
+	FILE* f;
+	for(op = 0; op < 256; op++){
+		free(agent_handler[op]);
+		agent_handler[op] = NULL;
+	}
+	f = fopen(AGENT_CONFIG, "r");
+	if(!f) return;
+	while(fgets(line, sizeof(line), f)){
+		line[strcspn(line, "\r\n")] = '\0';
+		op = strtol(line, &cmd, 0);
+		// blank lines and # comments don't start with a number.
+		if((cmd == line) || (op <= AGENT_OP_PING) || (op > 255)) continue;
+		cmd += strspn(cmd, " \t");
+		if(*cmd) agent_handler[op] = strdup(cmd);
+	}
+	fclose(f);
+}
+
+// run handler with arg as $1, keeping the first AGENT_OUT_MAX bytes it prints.
+// returns its status for the reply.
+static int agent_exec(const char* handler, const char* arg, unsigned char* out, int* outlen){
+	struct pollfd pfd;
+	unsigned char discard[256];
+	uint64_t deadline = now_us() + (uint64_t)AGENT_TIMEOUT_MS * 1000;
+	int64_t wait_ms;
+	int pipefd[2], devnull, i, n, status = 0;
+	pid_t pid;
+
+	*outlen = 0;
+	fflush(stdout);
+	fflush(stderr);
+	if(pipe(pipefd)) return 127;
+	pid = fork();
+	if(pid == -1){
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return 127;
+	}
+	if(pid == 0){
+		devnull = open("/dev/null", O_RDWR);
+		dup2(devnull, STDIN_FILENO);
+		dup2(pipefd[1], STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		// the port, its lock and our sockets stay with us.
+		for(i = 3; i < 1024; i++) close(i);
+		signal(SIGPIPE, SIG_DFL);
+		setpgid(0, 0); // so a timeout takes its children too.
+		execl("/bin/sh", "sh", "-c", handler, "sbdctl-agent", arg, (char*)NULL);
+		_exit(127);
+	}
+	setpgid(pid, pid);
+	close(pipefd[1]);
+
+	pfd.fd = pipefd[0];
+	pfd.events = POLLIN;
+	while(1){
+		wait_ms = ((int64_t)deadline - (int64_t)now_us()) / 1000;
+		if(wait_ms <= 0){
+			kill(-pid, SIGKILL);
+			break;
+		}
+		if(poll(&pfd, 1, wait_ms) <= 0) continue;
+		if(*outlen < AGENT_OUT_MAX){
+			n = read(pipefd[0], &out[*outlen], AGENT_OUT_MAX - *outlen);
+			if(n > 0) *outlen += n;
+		}
+		else n = read(pipefd[0], discard, sizeof(discard)); // keep it from blocking.
+		if(n <= 0) break;
+	}
+	close(pipefd[0]);
+
+	// it can close stdout and carry on, the deadline still holds.
+	while(waitpid(pid, &status, WNOHANG) == 0){
+		if(now_us() >= deadline) kill(-pid, SIGKILL);
+		usleep(10000);
+	}
+	if(WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+static void agent_queue_load(struct agent_queue* q){
+	int n, fd = open(AGENT_QUEUE_FILE, O_RDONLY);
+	bzero(q, sizeof(*q));
+	if(fd == -1) return;
+	n = read(fd, q, sizeof(*q));
+	close(fd);
+	if((n < (int)(sizeof(*q) - AGENT_QUEUE_MAX)) || (q->len > AGENT_QUEUE_MAX) ||
+		(q->loaded > q->len) || (n != sizeof(*q) - AGENT_QUEUE_MAX + q->len))
+		bzero(q, sizeof(*q));
+}
+
+// through a temp file, like the latency samples.
+static int agent_queue_save(const struct agent_queue* q){
+	char tmpname[] = AGENT_QUEUE_FILE ".XXXXXX";
+	int fd, len = sizeof(*q) - AGENT_QUEUE_MAX + q->len, err = 0;
+	fd = mkstemp(tmpname);
+	if(fd == -1) return -1;
+	if(write(fd, q, len) != len) err = -1;
+	close(fd);
+	if(err || rename(tmpname, AGENT_QUEUE_FILE)){
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+// returns 0, or -1 if the queue is full and the reply was dropped.
+static int agent_reply(struct agent_queue* q, int op, int seq, int status,
+	const unsigned char* out, int outlen){
+	unsigned char* p = &q->buf[q->len];
+	if(q->len + 4 + outlen > AGENT_QUEUE_MAX) return -1;
+	p[0] = op;
+	p[1] = seq;
+	p[2] = status;
+	p[3] = outlen;
+	memcpy(&p[4], out, outlen);
+	q->len += 4 + outlen;
+	return 0;
+}
+
+// as many whole replies from the front of the queue as fit one MO message.
+//  Marks them loaded.
+// returns the message length.
+static int agent_pack(struct agent_queue* q, unsigned char* msg){
+	int room = MAXBYTES - AEAD_OVERHEAD - 2;
+	int n = 0;
+	while((n < q->len) && (n + 4 + q->buf[n + 3] <= room))
+		n += 4 + q->buf[n + 3];
+	memcpy(msg, AGENT_REPLY_MAGIC, 2);
+	memcpy(&msg[2], q->buf, n);
+	q->loaded = n;
+	return n + 2;
+}
+
+// the loaded replies went out, forget them.
+static void agent_sent(struct agent_queue* q){
+	q->len -= q->loaded;
+	memmove(q->buf, &q->buf[q->loaded], q->len);
+	q->loaded = 0;
+}
+
+// run each command in an "AC" message and queue its reply.
+static void agent_dispatch(const unsigned char* msg, int len, struct agent_queue* q,
+	int* commands, int* dropped){
+	unsigned char out[AGENT_OUT_MAX];
+	char arg[256];
+	int p = 2, op, seq, alen, status, outlen;
+
+	while(p + 3 <= len){
+		op = msg[p];
+		seq = msg[p + 1];
+		alen = msg[p + 2];
+		if(p + 3 + alen > len) break;
+		memcpy(arg, &msg[p + 3], alen);
+		arg[alen] = '\0';
+		p += 3 + alen;
+
+		outlen = 0;
+		if(op == AGENT_OP_PING){
+			memcpy(out, arg, alen);
+			outlen = alen;
+			status = 0;
+		}
+		else if(!agent_handler[op]) status = AGENT_ST_UNKNOWN;
+		else status = agent_exec(agent_handler[op], arg, out, &outlen);
+		if(agent_reply(q, op, seq, status, out, outlen)) (*dropped)++;
+		(*commands)++;
+	}
+}
+
+// -A: one agent pass, see above.
+// returns 0, or -1 if the modem stopped answering.
+int agent_run(int fd, struct sbd_opts* opts){
+	static struct agent_queue q;
+	unsigned char msg[MAX_BUFF];
+	int r[SBDIX_FIELDS], f[SBDSX_FIELDS];
+	int s, len, mostat, err = 0;
+	int sessions = 0, commands = 0, rejected = 0, dropped = 0, sent = 0;
+
+	if(!aead_on){
+		rec_text("AGENT_ERROR", "commands must be authenticated, give -K first");
+		return -1;
+	}
+	agent_load_config();
+	agent_queue_load(&q);
+
+	// replies an earlier pass loaded may have gone out, or another process
+	//  may have loaded over them and sent its own message instead.  There's
+	//  no telling which, so they go again: a reply can arrive twice, but
+	//  it never goes missing.
+	q.loaded = 0;
+
+	for(s = 0; s < AGENT_MAX_SESSIONS; s++){
+		// the next batch of replies rides this session, if the MO buffer is
+		//  free.  If it isn't, this session sends what's there first.
+		if(q.len && !q.loaded && get_sbdsx(fd, f)){
+			err = -1;
+			break;
+		}
+		if(q.len && !q.loaded && !f[0]){
+			len = agent_pack(&q, msg);
+			if(send_payload(fd, msg, len) < 0){
+				q.loaded = 0;
+				err = -1;
+				break;
+			}
+			agent_queue_save(&q);
+		}
+		// -W only holds back the poll, replies go while the sky is known good.
+		if(!s && !session_likely(opts)) break;
+		mostat = sbdix(fd, r);
+		sessions++;
+		if(mostat < 0){
+			err = -1;
+			break;
+		}
+		if(mostat <= 4){
+			if(q.loaded){
+				sent += q.loaded;
+				agent_sent(&q);
+			}
+			// whatever was in the MO buffer is delivered.  Clear it or the
+			//  next session sends it again.
+			clearbufs(SBDD_CLEAR_MO_BUFF, fd);
+		}
+		agent_queue_save(&q);
+		if(r[2] == 1){
+			len = read_payload(fd, msg);
+			if(len < 0) rejected++;
+			else if((len >= 2) && !memcmp(msg, AGENT_CMD_MAGIC, 2)){
+				agent_dispatch(msg, len, &q, &commands, &dropped);
+				agent_queue_save(&q);
+			}
+			else {
+				// not a command.  Hand it over the way -Y would and stop so
+				//  the next session can't overwrite anything else.
+				fec_accept(msg, len);
+				break;
+			}
+		}
+		if(mostat > 4) break;         // no luck this pass.
+		if(!q.len && !r[5]) break;    // nothing to send, nothing waiting.
+	}
+
+	rec_int("AGENT_SESSIONS", sessions);
+	rec_int("AGENT_COMMANDS", commands);
+	rec_int("AGENT_REJECTED", rejected);
+	rec_int("AGENT_DROPPED", dropped);
+	rec_int("AGENT_REPLY_BYTES_SENT", sent);
+	rec_int("AGENT_REPLY_BYTES_PENDING", q.len);
+	board_agent(q.len);
+	return err;
 }
 
 //  This funciton is an example that runs through some
@@ -646,6 +2952,25 @@ static void usage(char* myname){
 		" -l, --clearmobuf          Clear Mobile Originated (MO) buffer.\n"
 		" -m, --clearmtbuf          Clear Mobile Terminated (MT) buffer.\n"
 		" -a, --cpymomtbuf          Copy mo to mt buffer on modem.\n"
+		" -g, --geo                 Report cached position and Iridium time, asking the modem if stale.\n"
+		" -G, --geo-maxage <secs>   Staleness bound for -g (default 600, give before -g).\n"
+		" -S, --serve <socket>      Own the port and run options sent by -C clients (does not return).\n"
+		" -C, --client <socket>     Send the options that follow to the -S server at <socket>.\n"
+		" -w, --weight <n>          Client's share of the modem relative to others (1-16, default 1).\n"
+		" -Q, --queue-stats         Report the server's queue depths and wait times (after -C).\n"
+		" -K, --key <file>          Seal -D and open -d payloads with the 32 byte key in <file>.\n"
+		"                           With -C the server's own -K decides, so it can't be given here.\n"
+		" -B, --bench               Benchmark payload envelope and FEC coding CPU time per message.\n"
+		" -b, --board               Report the status the port holder last published, without the port.\n"
+		" -A, --agent               Fetch MT commands, run their handlers, send replies (needs -K).\n"
+		" -H, --predict             Report session success chance now and the next good window.\n"
+		" -W, --when-likely <p>     Skip -c/-X when predicted success is below p (give before them).\n"
+		" -X, --fec-send <ratio>    Send stdin as k messages plus ceil(k*ratio) parity, one session each.\n"
+		" -Y, --fec-receive         Read MT buffer, output a -X transfer once any k of its n are in.\n"
+		" -F, --format <fmt>        Output one record per option as text (default), json or cbor.\n"
+		" -o, --output <dest>       Send json/cbor records to a file or unix:<socket> instead of stdout.\n"
+		" -R, --record <file>       Record all serial traffic to a trace file (give before other options).\n"
+		" -P, --replay <file>       Replay a recorded trace instead of using the serial port.\n"
 		" -z, --test                Programmer's test point: Not for release version.\n"
 		, myname);
 }
@@ -653,30 +2978,77 @@ static void usage(char* myname){
 int open_sbd_port(char* thePort){
 		// open the serial port
 	int temp;
-	int fd=open(thePort, O_RDWR | O_NOCTTY );
+	int fd;
+
+	strncpy(sbd_port, thePort, sizeof(sbd_port) - 1);
+
+	// replaying: the trace stands in for the port.  setup_modem() still
+	//  runs so the init string lines up with the recorded TX.
+	if(replay_fd != -1){
+		setup_modem(replay_fd);
+		return replay_fd;
+	}
+
+	latency_load();
+	atexit(latency_save_atexit);
+
+	fd=open(thePort, O_RDWR | O_NOCTTY );
 	if(fd==-1){
 		// process error.
 		fprintf(stderr, "PORT_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
-		abort();
+		return -1;
+	}
+
+	// one owner at a time, or exchanges interleave.  Wait our turn.  The
+	//  lock lives on its own descriptor: reinit_port() reopens fd, and the
+	//  lock would go with the old open file.
+	sbd_lock_fd = open(thePort, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(sbd_lock_fd == -1){
+		fprintf(stderr, "PORT_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(flock(sbd_lock_fd, LOCK_EX | LOCK_NB)){
+		fprintf(stderr, "PORT_BUSY=1\n");
+		if(flock(sbd_lock_fd, LOCK_EX)){
+			fprintf(stderr, "LOCK_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+			close(sbd_lock_fd);
+			close(fd);
+			return -1;
+		}
 	}
 
 	temp = serial_init(fd);
 	if(temp ==-1){
 		// handle error.
 		fprintf(stderr, "INIT_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
-		abort();
+		close(fd);
+		return -1;
 	}
 
 	temp = setup_modem(fd);
 	if(temp == -1) {
 		// handle error.
 		fprintf(stderr, "SETUP_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
-		abort();
+		close(fd);
+		return -1;
 	}
 
 	return fd;
 }
 
+// Opens the port on first use.  Nothing else can run without the modem,
+//  so bail out if it can't be brought up.
+static int need_port(int fd, char* thePort){
+	if(fd != -1) return fd;
+	fd = open_sbd_port(thePort);
+	if(fd == -1){
+		rec_end(-1);
+		exit(1);
+	}
+	return fd;
+}
+
 // copies mobuf to mtbuf inside the modem.
 // returns number of bytes copied from MO to MT.
 int cpymomtbuf(int fd){
@@ -685,129 +3057,635 @@ int cpymomtbuf(int fd){
 	write_to_imu("at+sbdtc\r\n", strlen("at+sbdtc\r\n"), fd);
 	read_from_imu(buf, fd);
 	sscanf(buf, "SBDTC: Outbound SBD Copied to Inbound SBD: size = %d", &len);
-	fprintf(stderr, "MOMTCP_BYTES=%d\n", len);
+	rec_int("MOMTCP_BYTES", len);
 	return len;
 }
 
+// long options here.  format:
+// "option", argument (no_ or rquired_), flag pointer (or 0?), 'char' short opt.
+static struct option longopts[] =
+{
+	{"port",	required_argument, 	0, 'p'},  // /dev/tty...
+	{"connect", no_argument, 		0, 'c'},  // at+sbdix -- initiate radio contact.
+	{"tread",	no_argument, 		0, 't'},  // text read from modem MT buffer
+	{"dread",	no_argument, 		0, 'd'},  // data read from modem MT buffer
+	{"twrite", 	required_argument, 	0, 'T'},  // text write <len> bytes to modem MO buffer.
+	{"dwrite",	no_argument, 		0, 'D'},  // data write <len> bytes to modem MO buffer with checksum.
+	{"rssi",	no_argument,		0, 'r'},  // request rssi from modem
+	{"status",	no_argument,		0, 's'},  // request modem status
+	{"events", 	no_argument,		0, 'e'},  // request running events XXX remove this?
+	{"info", 	no_argument,		0, 'i'},  // info grab
+	{"clearbufs", no_argument, 		0, 'k'},  // Clear all message indexes
+	{"clearmobuf", no_argument,		0, 'l'},  // Clear MO index
+	{"clearmtbuf", no_argument,		0, 'm'},  // Clear MT index
+	{"cpymomtbuf", no_argument,	    0, 'a'},  // XXX TEST cp MO buf to MT buf for testing.
+	{"geo",		no_argument,		0, 'g'},  // cached position and time
+	{"geo-maxage", required_argument, 0, 'G'}, // staleness bound for --geo
+	{"key",		required_argument,	0, 'K'},  // payload envelope key file.
+	{"bench",	no_argument,		0, 'B'},  // payload processing benchmark.
+	{"board",	no_argument,		0, 'b'},  // last published modem status, no port.
+	{"agent",	no_argument,		0, 'A'},  // one pass of the MT command agent.
+	{"predict",	no_argument,		0, 'H'},  // session success chance and next window.
+	{"when-likely", required_argument, 0, 'W'}, // hold sessions back below this chance.
+	{"fec-send", required_argument,	0, 'X'},  // send stdin as an erasure coded transfer.
+	{"fec-receive", no_argument,	0, 'Y'},  // read MT, rebuild transfers.
+	{"record",	required_argument,	0, 'R'},  // record serial traffic to trace file.
+	{"replay",	required_argument,	0, 'P'},  // replay trace file in place of serial port.
+	{"serve",	required_argument,	0, 'S'},  // own the port, run clients' options.
+	{"client",	required_argument,	0, 'C'},  // send the following options to a server.
+	{"weight",	required_argument,	0, 'w'},  // this client's share of the modem.
+	{"queue-stats", no_argument,	0, 'Q'},  // server queue metrics.
+	{"format",	required_argument,	0, 'F'},  // text, json or cbor records.
+	{"output",	required_argument,	0, 'o'},  // records to file or unix:<socket>.
+	{"test",	no_argument,		0, 'z'},  // XXX TEST ARG <-------------------------<<<
+	{0, 0, 0, 0}
+};
+
+// Runs one modem option.  Shared by the command line and arbitration jobs.
+// returns 0, or -1 if c isn't a modem option.
+int run_option(int c, char* arg, struct sbd_opts* opts){
+	int bytes, result, len;
+	int err = 0;
+	struct geo_cache geo;
+	struct option* lo;
+
+	for(lo = longopts; lo->name && (lo->val != c); lo++);
+	if(!lo->name || !strchr(ARB_JOB_OPTS "ez", c)) return -1;
+	rec_begin(lo->name);
+
+	switch(c){
+		case 'c':
+			opts->fd = need_port(opts->fd, opts->port);
+			if(!session_likely(opts)) break;
+			result = sbdopensession(opts->fd);
+			// MO status 0-4 is success, anything else is the error.
+			if((result < 0) || (result > 4)) err = result;
+			break;
+		case 't':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = print_text_data(opts->fd);
+			break;
+		case 'd':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = dread(opts->fd);
+			break;
+		case 'T':
+			opts->fd = need_port(opts->fd, opts->port);
+			sscanf(arg, "%d", &len);
+			if(len > MAX_BUFF) {
+				fprintf(stderr, "Message length must be less than 340 bytes!\n");
+				err = -1;
+				break;
+			}
+			result = sending_text(opts->fd, len);
+			if(result < 0) err = -1;
+			break;
+		case 'D':
+			opts->fd = need_port(opts->fd, opts->port);
+			sscanf(arg, "%d", &len);
+			result = sending_binary(opts->fd, len);
+			if(result < 0) err = -1;
+			break;
+		case 'r':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = getsbdrssi(opts->fd);
+			break;
+		case 's':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = getsbdstatus(opts->fd);
+			break;
+		case 'e': // XXX modem can send unsolicited messages to sbc. (like rssi changes) 
+				  // XXX  Not sure how to implement though.  Remove?
+			break;
+		case 'i':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = info(opts->fd);
+			break;
+		case 'k':  // clear both mo and mt indexes
+			opts->fd = need_port(opts->fd, opts->port);
+			err = result = clearbufs(SBDD_CLEAR_ALL_BUFF, opts->fd);
+			if(out_format == FMT_TEXT)
+				fprintf(stderr, (result == 0) ? "SBD Buffers cleared!\n" : "SBD Buffer clear failed.\n");
+			break;
+		case 'l':  // clear mo idx.
+			opts->fd = need_port(opts->fd, opts->port);
+			err = result = clearbufs(SBDD_CLEAR_MO_BUFF, opts->fd);
+			if(out_format == FMT_TEXT)
+				fprintf(stderr, (result == 0) ? "SBD MO Buffer cleared!\n" : "SBD Buffer clear failed.\n");
+			break;
+		case 'm':  // clear mt idx.
+			opts->fd = need_port(opts->fd, opts->port);
+			err = result = clearbufs(SBDD_CLEAR_MT_BUFF, opts->fd);
+			if(out_format == FMT_TEXT)
+				fprintf(stderr, (result == 0) ? "SBD MT Buffer cleared!\n" : "SBD Buffer clear failed.\n");
+			break;
+		case 'a':  // copy mo buffer to mt buffer.
+			opts->fd = need_port(opts->fd, opts->port);
+			bytes = cpymomtbuf(opts->fd);
+			break;
+		case 'X':
+			opts->fd = need_port(opts->fd, opts->port);
+			if(session_likely(opts)) err = fec_send(opts->fd, arg);
+			break;
+		case 'Y':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = fec_receive(opts->fd);
+			break;
+		case 'A':
+			opts->fd = need_port(opts->fd, opts->port);
+			err = agent_run(opts->fd, opts);
+			break;
+		case 'g':
+			geo_load(&geo);
+			if(time(NULL) - geo.fetched > opts->geo_maxage){
+				opts->fd = need_port(opts->fd, opts->port);
+				err = geo_refresh(opts->fd, &geo);
+			}
+			print_geo(&geo);
+			break;
+		case 'z':
+			opts->fd = need_port(opts->fd, opts->port);
+			test_function(opts->fd);
+			break;
+	}
+	rec_end(err);
+	return 0;
+}
+
+// Multi-client arbitration
+//  sbdctl -S <socket> owns the serial port and runs options on behalf of
+//  clients started as sbdctl -C <socket> [-w <weight>] <options...>.  The
+//  client sends its options in one message along with its stdin, stdout and
+//  stderr, which the server borrows while running that client's jobs, so
+//  the output is the same as running sbdctl directly.
+//
+//  Each client's options run in order from its own queue.  Between clients:
+//   - Quick jobs go ahead of sessions (-c, -X, -A), so a status query waits
+//     for at most the session already on the air, not every queued one.  A
+//     session that has waited ARB_AGE_MS competes as a quick job so it
+//     can't starve.
+//   - Within a class, clients share the modem by weight (smooth weighted
+//     round robin).
+//   - A client that just loaded the MO buffer, or reads the MT buffer right
+//     after its session, keeps the modem until that sequence is done so no
+//     other client's message lands in between.
+struct arb_job {
+	char opt;
+	char arg[16];
+	uint64_t queued_us;
+};
+
+struct arb_client {
+	int sock;                         // -1 when the slot is free
+	int stdfd[3];                     // client's stdin, stdout, stderr
+	int format;                       // client's -F, FMT_*
+	int weight, current;              // smooth weighted round robin
+	struct arb_job jobs[ARB_MAX_JOBS];
+	int head, count;
+	unsigned int served;
+};
+
+static struct arb_client arb[ARB_MAX_CLIENTS];
+static int arb_hold = -1;             // client that keeps the modem, or -1
+static unsigned int arb_max_depth;
+static unsigned int arb_served[2];
+static uint64_t arb_waited_us[2];
+
+static void arb_drop(int i, int status){
+	char reply[16];
+	int k;
+	sprintf(reply, "DONE %d\n", status);
+	write(arb[i].sock, reply, strlen(reply));
+	close(arb[i].sock);
+	for(k = 0; k < 3; k++) close(arb[i].stdfd[k]);
+	arb[i].sock = -1;
+	arb[i].count = 0;
+	if(arb_hold == i) arb_hold = -1;
+}
+
+static int arb_depth(void){
+	int i, depth = 0;
+	for(i = 0; i < ARB_MAX_CLIENTS; i++)
+		if(arb[i].sock != -1) depth += arb[i].count;
+	return depth;
+}
+
+// queue-depth metrics.
+static void arb_stats(void){
+	char key[32];
+	int i, clients = 0;
+	for(i = 0; i < ARB_MAX_CLIENTS; i++)
+		if((arb[i].sock != -1) && arb[i].count) clients++;
+	rec_int("ARB_CLIENTS", clients);
+	rec_int("ARB_QUEUED", arb_depth());
+	rec_int("ARB_MAX_DEPTH", arb_max_depth);
+	rec_int("ARB_QUICK_SERVED", arb_served[ARB_QUICK]);
+	rec_int("ARB_QUICK_WAIT_MS", arb_served[ARB_QUICK] ?
+		arb_waited_us[ARB_QUICK] / arb_served[ARB_QUICK] / 1000 : 0);
+	rec_int("ARB_SESSION_SERVED", arb_served[ARB_SESSION]);
+	rec_int("ARB_SESSION_WAIT_MS", arb_served[ARB_SESSION] ?
+		arb_waited_us[ARB_SESSION] / arb_served[ARB_SESSION] / 1000 : 0);
+	for(i = 0; i < ARB_MAX_CLIENTS; i++){
+		if((arb[i].sock == -1) || !arb[i].count) continue;
+		sprintf(key, "ARB_CLIENT%d_WEIGHT", i);
+		rec_int(key, arb[i].weight);
+		sprintf(key, "ARB_CLIENT%d_DEPTH", i);
+		rec_int(key, arb[i].count);
+		sprintf(key, "ARB_CLIENT%d_SERVED", i);
+		rec_int(key, arb[i].served);
+	}
+}
+
+// swap client i's fds and output format in for ours, saving ours in saved.
+static int arb_borrow(int i, int* saved){
+	int k, format = out_format;
+	fflush(stdout);
+	for(k = 0; k < 3; k++){
+		saved[k] = dup(k);
+		dup2(arb[i].stdfd[k], k);
+	}
+	out_format = arb[i].format;
+	return format;
+}
+
+static void arb_return(int* saved, int format){
+	int k;
+	fflush(stdout);
+	for(k = 0; k < 3; k++){
+		dup2(saved[k], k);
+		close(saved[k]);
+	}
+	out_format = format;
+}
+
+// take one request off a freshly accepted socket and queue its jobs.
+//  Request:  "SBD1 <weight>\n" then "<option>[ <arg>]\n" per job,
+//  with the client's fds 0, 1 and 2 attached.
+static void arb_receive(int sock){
+	char req[ARB_REQ_MAX + 1];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { req, ARB_REQ_MAX };
+	struct msghdr msg = { 0 };
+	struct cmsghdr* cmsg;
+	struct timeval tv = { 1, 0 };
+	struct arb_client* cl;
+	char* line;
+	char* save;
+	int stdfd[3], saved[3];
+	int i, k, len, weight;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	// a client that connects and says nothing can't hold up everyone else.
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	len = recvmsg(sock, &msg, 0);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	for(i = 0; (i < ARB_MAX_CLIENTS) && (arb[i].sock != -1); i++);
+	if((len <= 0) || !cmsg || (cmsg->cmsg_type != SCM_RIGHTS) ||
+		(cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))){
+		close(sock);
+		return;
+	}
+	memcpy(stdfd, CMSG_DATA(cmsg), sizeof(stdfd));
+	if(i == ARB_MAX_CLIENTS){
+		// no room, turn it away.
+		for(k = 0; k < 3; k++) close(stdfd[k]);
+		write(sock, "DONE 1\n", 7);
+		close(sock);
+		return;
+	}
+	cl = &arb[i];
+	memcpy(cl->stdfd, stdfd, sizeof(stdfd));
+	cl->sock = sock;
+	cl->head = cl->count = 0;
+	cl->current = 0;
+	cl->served = 0;
+	cl->format = FMT_TEXT;
+
+	req[len] = '\0';
+	line = strtok_r(req, "\n", &save);
+	if(!line || (sscanf(line, ARB_MAGIC " %d", &weight) != 1)){
+		arb_drop(i, 1);
+		return;
+	}
+	if(weight < 1) weight = 1;
+	if(weight > ARB_MAX_WEIGHT) weight = ARB_MAX_WEIGHT;
+	cl->weight = weight;
+
+	while((line = strtok_r(NULL, "\n", &save))){
+		// -Q is answered now, it never waits behind the modem.
+		if(line[0] == 'Q'){
+			k = arb_borrow(i, saved);
+			rec_begin("queue-stats");
+			arb_stats();
+			rec_end(0);
+			arb_return(saved, k);
+			continue;
+		}
+		if(line[0] == 'F'){
+			if(!strcmp(line, "F json")) cl->format = FMT_JSON;
+			else if(!strcmp(line, "F cbor")) cl->format = FMT_CBOR;
+			else cl->format = FMT_TEXT;
+			continue;
+		}
+		if(!line[0] || !strchr(ARB_JOB_OPTS, line[0]) || (cl->count == ARB_MAX_JOBS)){
+			dprintf(cl->stdfd[2], "ARB_ERROR=\"bad job %s\"\n", line);
+			arb_drop(i, 1);
+			return;
+		}
+		cl->jobs[cl->count].opt = line[0];
+		strncpy(cl->jobs[cl->count].arg, (line[1] == ' ') ? &line[2] : "",
+			sizeof(cl->jobs[0].arg) - 1);
+		cl->jobs[cl->count].arg[sizeof(cl->jobs[0].arg) - 1] = '\0';
+		cl->jobs[cl->count].queued_us = now_us();
+		cl->count++;
+	}
+	if(!cl->count){
+		arb_drop(i, 0);
+		return;
+	}
+	if(arb_depth() > arb_max_depth) arb_max_depth = arb_depth();
+}
+
+static int arb_class(struct arb_job* job, uint64_t now){
+	if(strchr("cXA", job->opt) && (now - job->queued_us < (uint64_t)ARB_AGE_MS * 1000))
+		return ARB_SESSION;
+	return ARB_QUICK;
+}
+
+// choose whose job runs next.  returns client index or -1 if nothing's queued.
+static int arb_pick(void){
+	int i, cls, total, best = -1;
+	uint64_t now = now_us();
+
+	if((arb_hold != -1) && arb[arb_hold].count) return arb_hold;
+	arb_hold = -1;
+
+	for(cls = ARB_QUICK; (cls <= ARB_SESSION) && (best == -1); cls++){
+		total = 0;
+		for(i = 0; i < ARB_MAX_CLIENTS; i++){
+			if((arb[i].sock == -1) || !arb[i].count ||
+				(arb_class(&arb[i].jobs[arb[i].head], now) != cls))
+				continue;
+			arb[i].current += arb[i].weight;
+			total += arb[i].weight;
+			if((best == -1) || (arb[i].current > arb[best].current)) best = i;
+		}
+		if(best != -1) arb[best].current -= total;
+	}
+	return best;
+}
+
+// run the next job of client i with its fds standing in for ours.
+static void arb_run(struct sbd_opts* opts, int i){
+	struct arb_client* cl = &arb[i];
+	struct arb_job* job = &cl->jobs[cl->head];
+	struct pollfd pfd = { cl->sock, POLLIN, 0 };
+	uint64_t now = now_us();
+	int saved[3], format, cls, next;
+
+	// client went away, nobody to run it for.
+	if(poll(&pfd, 1, 0) > 0){
+		arb_drop(i, 1);
+		return;
+	}
+
+	cls = arb_class(job, now);
+	arb_served[cls]++;
+	arb_waited_us[cls] += now - job->queued_us;
+
+	format = arb_borrow(i, saved);
+	run_option(job->opt, job->arg, opts);
+	arb_return(saved, format);
+
+	// we never exit, so the atexit() save would never happen.
+	latency_save();
+
+	cl->head++;
+	cl->count--;
+	cl->served++;
+	next = cl->count ? cl->jobs[cl->head].opt : 0;
+
+	// keep the modem across MO load -> session -> MT read.
+	if((job->opt == 'D') || (job->opt == 'T') ||
+		(strchr("ctdY", job->opt) && next && strchr("tdY", next)))
+		arb_hold = i;
+	else
+		arb_hold = -1;
+
+	if(!cl->count) arb_drop(i, 0);
+}
+
+// own the port and serve clients on the unix socket at path.  Doesn't return
+//  unless the socket can't be set up.
+int arb_serve(char* path, struct sbd_opts* opts){
+	struct sockaddr_un addr = { AF_UNIX };
+	struct pollfd pfd;
+	int i, lsock;
+
+	lsock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(lsock == -1) return -1;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if(bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) || listen(lsock, ARB_MAX_CLIENTS)){
+		close(lsock);
+		return -1;
+	}
+
+	opts->fd = need_port(opts->fd, opts->port);
+	signal(SIGPIPE, SIG_IGN); // a client closing its stdout mustn't take us down.
+	input_deadline_ms = ARB_STDIN_MS;
+	for(i = 0; i < ARB_MAX_CLIENTS; i++) arb[i].sock = -1;
+
+	while(1){
+		// take in every waiting request before choosing, so the choice is fair.
+		pfd.fd = lsock;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, arb_depth() ? 0 : -1) > 0){
+			i = accept(lsock, NULL, NULL);
+			if(i != -1) arb_receive(i);
+			continue;
+		}
+		i = arb_pick();
+		if(i != -1) arb_run(opts, i);
+	}
+}
+
+// send jobs to the server at path and wait for them to finish.
+// returns the server's status for the request, or -1 if it couldn't be reached.
+int arb_request(char* path, int weight, char* jobs, int len){
+	struct sockaddr_un addr = { AF_UNIX };
+	char req[ARB_REQ_MAX];
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	int stdfd[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct iovec iov;
+	struct msghdr msg = { 0 };
+	struct cmsghdr* cmsg;
+	int sock, status = -1;
+
+	len = snprintf(req, sizeof(req), ARB_MAGIC " %d\n%.*s", weight, len, jobs);
+	if(len >= sizeof(req)) return -1;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(sock == -1) return -1;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(connect(sock, (struct sockaddr*)&addr, sizeof(addr))){
+		close(sock);
+		return -1;
+	}
+
+	iov.iov_base = req;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(stdfd));
+	memcpy(CMSG_DATA(cmsg), stdfd, sizeof(stdfd));
+
+	if(sendmsg(sock, &msg, 0) == len){
+		len = read(sock, req, sizeof(req) - 1);
+		if(len > 0){
+			req[len] = '\0';
+			sscanf(req, "DONE %d", &status);
+		}
+	}
+	close(sock);
+	return status;
+}
+
 int main(int argc, char** argv)
 {
-	int fd = -1;  		// file handle for serial port.
-	FILE * output_fd = NULL;
 	int c;   			// return value of getopt_long.
 	int longindex = 0; 	// getopt_long wants this.
-	int temp = -1;
-	char thePort[12] = {"/dev/ttyS12"};
-	char* outfile = NULL;
-	int bytes, result, len;
+	struct sbd_opts opts = { -1, "/dev/ttyS12", GEO_MAX_AGE, 0 };
+	char* arb_path = NULL;  // set by -C, options go to the server from then on.
+	char arb_jobs[ARB_REQ_MAX];
+	int arb_len = 0;
+	int arb_weight = 1;
+	int result;
 
-	// long options here.  format:
-	// "option", argument (no_ or rquired_), flag pointer (or 0?), 'char' short opt.
-	static struct option longopts[] = 
-	{
-		{"port",	required_argument, 	0, 'p'},  // /dev/tty...
-		{"connect", no_argument, 		0, 'c'},  // at+sbdix -- initiate radio contact.
-		{"tread",	no_argument, 		0, 't'},  // text read from modem MT buffer
-		{"dread",	no_argument, 		0, 'd'},  // data read from modem MT buffer
-		{"twrite", 	required_argument, 	0, 'T'},  // text write <len> bytes to modem MO buffer.
-		{"dwrite",	no_argument, 		0, 'D'},  // data write <len> bytes to modem MO buffer with checksum.
-		{"rssi",	no_argument,		0, 'r'},  // request rssi from modem
-		{"status",	no_argument,		0, 's'},  // request modem status
-		{"events", 	no_argument,		0, 'e'},  // request running events XXX remove this?
-		{"info", 	no_argument,		0, 'i'},  // info grab
-		{"clearbufs", no_argument, 		0, 'k'},  // Clear all message indexes
-		{"clearmobuf", no_argument,		0, 'l'},  // Clear MO index
-		{"clearmtbuf", no_argument,		0, 'm'},  // Clear MT index
-		{"cpymomtbuf", no_argument,	    0, 'a'},  // XXX TEST cp MO buf to MT buf for testing.
-		{"test",	no_argument,		0, 'z'},  // XXX TEST ARG <-------------------------<<<
-		{0, 0, 0, 0}
-	};
 
 	// do until done
 	while (1){
-		c=getopt_long(argc, argv, "p:ctdT:D:rseiklmaz", longopts, &longindex);
+		c=getopt_long(argc, argv, "p:ctdT:D:rseiklmagG:K:BHW:X:YAbR:P:S:C:w:QF:o:z", longopts, &longindex);
 		if((c == -1) && (argc == 1)){
 			usage(argv[0]);
 			return 1;  // Bail & fail if no options provided.
 		}
 		else if (c == -1) break; // detect end of options list and exit.
 
+		// client mode: queue it up for the server instead.
+		if(arb_path && ((c == 'Q') || (c == 'F') || (c && strchr(ARB_JOB_OPTS, c)))){
+			arb_len += snprintf(&arb_jobs[arb_len], sizeof(arb_jobs) - arb_len,
+				strchr("TDFX", c) ? "%c %s\n" : "%c\n", c, optarg);
+			if(arb_len >= sizeof(arb_jobs)){
+				fprintf(stderr, "Too many options for one request.\n");
+				return 1;
+			}
+			continue;
+		}
+
 		switch(c){
 			case 'p':
-				strncpy(thePort, optarg, (sizeof(char)*11));
-				fprintf(stderr, "SBDPORT=%s\n", thePort);
+				strncpy(opts.port, optarg, (sizeof(char)*11));
+				rec_begin("port");
+				rec_str("SBDPORT", opts.port);
+				rec_end(0);
 				break;
-			case 'c':
-				if(fd == -1) fd = open_sbd_port(thePort);
-				sbdopensession(fd);
+			case 'F':
+				if(out_set_format(optarg)){
+					fprintf(stderr, "Unknown format %s, use text, json or cbor.\n", optarg);
+					return 1;
+				}
 				break;
-			case 't':
-				if(fd == -1) fd = open_sbd_port(thePort);
-				print_text_data(fd);
+			case 'o':
+				if(out_open(optarg)){
+					fprintf(stderr, "OUTPUT_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+					return 1;
+				}
 				break;
-			case 'd':
-				if(fd == -1) fd = open_sbd_port(thePort);
-				dread(fd);
+			case 'G':
+				sscanf(optarg, "%d", &opts.geo_maxage);
 				break;
-			case 'T':
-				if(fd == -1) fd = open_sbd_port(thePort);
-				sscanf(optarg, "%d", &len);
-				if(len > MAX_BUFF) {
-					fprintf(stderr, "Message length must be less than 340 bytes!");
-					abort();
+			case 'K':
+				// a server's payloads are sealed or not by its own -K.
+				if(arb_path){
+					fprintf(stderr, "KEY_ERROR=\"-K has no effect with -C, the server seals with its own -K.\"\n");
+					return 1;
+				}
+				if(aead_load_key(optarg)){
+					fprintf(stderr, "KEY_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+					return 1;
 				}
-				result = sending_text(fd, len);
-				break;
-			case 'D':
-				if(fd == -1) fd = open_sbd_port(thePort);
-				sscanf(optarg, "%d", &len);
-				result = sending_binary(fd, len);
 				break;
-			case 'r':
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				getsbdrssi(fd);
+			case 'W':
+				sscanf(optarg, "%lf", &opts.min_p);
 				break;
-			case 's':
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				getsbdstatus(fd);
+			case 'b':
+				rec_begin("board");
+				rec_end(print_board());
 				break;
-			case 'e': // XXX modem can send unsolicited messages to sbc. (like rssi changes) 
-					  // XXX  Not sure how to implement though.  Remove?
+			case 'H':
+				rec_begin("predict");
+				print_prediction((opts.min_p > 0) ? opts.min_p : HIST_GOOD_P);
+				rec_end(0);
 				break;
-			case 'i':
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				info(fd);
+			case 'B':
+				rec_begin("bench");
+				bench();
+				fec_bench();
+				rec_end(0);
 				break;
-			case 'k':  // clear both mo and mt indexes
-				if(fd == -1) 	fd = open_sbd_port(thePort);
-				result = clearbufs(SBDD_CLEAR_ALL_BUFF, fd);
-				if(result == 0)	fprintf(stderr, "SBD Buffers cleared!\n");
-				else fprintf(stderr, "SBD Buffer clear failed.\n");
+			case 'R':
+				if(trace_record_open(optarg)){
+					fprintf(stderr, "TRACE_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+					return 1;
+				}
 				break;
-			case 'l':  // clear mo idx.
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				result = clearbufs(SBDD_CLEAR_MO_BUFF, fd);
-				if(result == 0)	fprintf(stderr, "SBD MO Buffer cleared!\n");
-				else fprintf(stderr, "SBD Buffer clear failed.\n");
+			case 'P':
+				if(trace_replay_open(optarg)){
+					fprintf(stderr, "TRACE_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+					return 1;
+				}
 				break;
-			case 'm':  // clear mt idx.
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				result = clearbufs(SBDD_CLEAR_MT_BUFF, fd);
-				if(result == 0)	fprintf(stderr, "SBD MT Buffer cleared!\n");
-				else fprintf(stderr, "SBD Buffer clear failed.\n");
+			case 'S':
+				arb_serve(optarg, &opts);
+				fprintf(stderr, "SERVE_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+				return 1;
+			case 'C':
+				if(aead_on){
+					fprintf(stderr, "KEY_ERROR=\"-K has no effect with -C, the server seals with its own -K.\"\n");
+					return 1;
+				}
+				arb_path = optarg;
 				break;
-			case 'a':  // copy mo buffer to mt buffer.
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				bytes = cpymomtbuf(fd);
+			case 'w':
+				sscanf(optarg, "%d", &arb_weight);
 				break;
-			case 'z':
-				if(fd == -1)	fd = open_sbd_port(thePort);
-				test_function(fd);
+			case 'Q':
+				fprintf(stderr, "Queue stats come from a server, give -C first.\n");
 				break;
 			default:
-				usage(argv[0]);
+				if(run_option(c, optarg, &opts)) usage(argv[0]);
 		}
 	}
+
+	if(arb_path && arb_len){
+		result = arb_request(arb_path, arb_weight, arb_jobs, arb_len);
+		if(result == -1)
+			fprintf(stderr, "SERVER_ERROR=%d\nERROR_STR=\"%s.\"\n", errno, strerror(errno));
+		return result ? 1 : 0;
+	}
+
 //  Cleanup:  Close the port, release any mmap'd variables, etc. 
-	close(fd);
+	trace_close();
+	close(opts.fd);
 	return 0;
 }
@@ -34,14 +34,197 @@
 #define SBD_WRITE_TEXT_INLINE "at+sbdwt=%s\r\n" // Inline text write (<120 chars)
 #define SBD_WRITE_TEXT "at+sbdwt\r\n"        // Write text (up to 340 chars, terminated by CR)
 #define SBD_READ_TEXT "at+sbdrt\r\n"         // Read text data
+#define SBDIX_FIELDS 6                       // +SBDIX: MO status, MOMSN, MT status, MTMSN, MT length, MT queued
+#define SBDSX_FIELDS 6                       // +SBDSX: MO flag, MOMSN, MT flag, MTMSN, RA flag, MT waiting
 
 // Buffer Clearing Options
 #define SBDD_CLEAR_MO_BUFF 0
 #define SBDD_CLEAR_MT_BUFF 1
 #define SBDD_CLEAR_ALL_BUFF 2
 
+// Trace Record/Replay
+#define TRACE_MAGIC "SBDT"                  // Trace file signature
+#define TRACE_VERSION 1
+#define TRACE_TX 0                          // SBC to IMU chunk
+#define TRACE_RX 1                          // IMU to SBC chunk
+
+// Adaptive Read Timeouts
+#define LATENCY_FILE "/var/tmp/sbdctl.latency" // Learned response times, kept across runs
+#define LATENCY_MAGIC "SBDL"                // Latency file signature
+#define LATENCY_VERSION 1
+#define LATENCY_SAMPLES 32                  // Response times kept per command class
+#define LATENCY_MIN_SAMPLES 4               // Use class default until this many
+#define LATENCY_PERCENTILE 95               // Deadline is based on this percentile
+#define LATENCY_MARGIN_MS 500               // Added on top of the scaled percentile
+#define LATENCY_GAP_MS 1000                 // Wait for the rest of a response once it starts
+
+// AT Command Classes (for response timing)
+#define CMD_QUICK 0                         // ati, at+gsn, at+sbdsx, at-msgeo ...
+#define CMD_SIGNAL 1                        // at+csq, modem measures RSSI first
+#define CMD_TRANSFER 2                      // at+sbdwb/rb/wt/rt, at+sbdd, at+sbdtc
+#define CMD_SESSION 3                       // at+sbdix, satellite round trip
+#define CMD_CLASSES 4
+
+// Fault Recovery
+#define RETRY_MAX 3                         // Attempts per exchange before giving up
+#define RESYNC_PROBE "ati0\r\n"             // Short fixed reply (plain "at" is silent in q1)
+#define FAULT_NONE 0
+#define FAULT_TIMEOUT 1                     // No reply before the deadline
+#define FAULT_ERROR 2                       // Modem answered ERROR
+#define FAULT_CHECKSUM 3                    // Checksum mismatch (+SBDWB result 2)
+#define FAULT_SIZE 4                        // Message size wrong (+SBDWB result 3)
+#define FAULT_DESYNC 5                      // Reply doesn't fit the command
+#define FAULT_IO 6                          // Port read/write failed
+
+// Geolocation and System Time Cache
+#define GEO_CACHE_FILE "/var/tmp/sbdctl.geo" // Last -MSGEO/-MSSTM, kept across runs
+#define GEO_MAGIC "SBDG"                    // Cache file signature
+#define GEO_VERSION 1
+#define GEO_MAX_AGE 600                     // Default staleness bound for -g, seconds
+#define GEO_REFRESH_AGE 60                  // Don't refresh after a session more often
+#define IRIDIUM_EPOCH 1399818235            // 11 May 2014 14:23:55 UTC as unix time
+#define IRIDIUM_TICK_MS 90                  // -MSSTM and -MSGEO count 90 ms frames
+#define WGS84_E2 0.00669437999014           // WGS84 first eccentricity squared
+
+struct geo_cache {
+	int64_t fetched;                        // unix time the modem was asked, 0 if never
+	int32_t x, y, z;                        // -MSGEO ECEF grid, all 0 if no fix
+	uint32_t geo_ticks;                     // -MSGEO fix time, Iridium frames
+	uint32_t msstm;                         // -MSSTM system time, Iridium frames
+	uint8_t geo_valid;
+	uint8_t msstm_valid;                    // 0 when modem reports no network service
+	double lat, lon;                        // geodetic degrees from x,y,z
+};
+
+// Signal History and Pass Prediction
+#define HISTORY_FILE "/var/tmp/sbdctl.history" // mmap'd ring of samples, kept across runs
+#define HISTORY_MAGIC "SBDH"                // History file signature
+#define HISTORY_VERSION 1
+#define HISTORY_SLOTS 8192                  // Samples kept, 8 bytes each
+#define HIST_RSSI 1                         // +CSQ sample
+#define HIST_SERVICE 2                      // -MSSTM had network service or not
+#define HIST_SESSION 3                      // SBDIX MO status
+#define HIST_BINS 48                        // Time of day bins, UTC
+#define HIST_FRESH 300                      // RSSI sample this recent stands for now, seconds
+#define HIST_MAX_AGE (7 * 86400)            // Older samples no longer count, so a bad bin gets retried
+#define HIST_MIN_SESSIONS 10                // -W doesn't hold sessions back until this many
+#define HIST_GOOD_P 0.7                     // Default success probability for a good window
+struct hist_entry {
+	uint32_t time;                          // unix seconds
+	uint8_t kind;                           // HIST_*
+	int8_t rssi;                            // 0-5, -1 if unknown
+	int8_t status;                          // MO status for sessions, 0/1 for service
+	uint8_t pad;
+};
+struct hist_ring {
+	char magic[4];
+	uint32_t version;
+	uint32_t head;                          // next slot written
+	uint32_t count;
+	struct hist_entry e[HISTORY_SLOTS];
+};
+
+// Output Formats
+#define FMT_TEXT 0                          // KEY=VALUE lines on stderr, data on stdout
+#define FMT_JSON 1                          // One JSON object per line
+#define FMT_CBOR 2                          // One CBOR map per record
+#define REC_MAX 32768                       // Largest encoded record, fits a base64 -Y transfer
+
+// Payload Envelope (ChaCha20-Poly1305)
+#define AEAD_KEY_LEN 32
+#define AEAD_CTR_LEN 4                      // Nonce counter sent with each message
+#define AEAD_TAG_LEN 8                      // Poly1305 tag, truncated
+#define AEAD_OVERHEAD (AEAD_CTR_LEN + AEAD_TAG_LEN)
+#define AEAD_DIR_MO 0x01                    // Nonce direction byte, SBC to ground
+#define AEAD_DIR_MT 0x02                    // Ground to SBC
+#define AEAD_STATE_EXT ".ctr"               // Counter state kept next to the key file
+#define BENCH_ROUNDS 2000                   // Messages per -B measurement
+// Forward Error Correction
+#define FEC_MAGIC "FC"                      // First bytes of every shard message
+#define FEC_HDR_LEN 9                       // Magic, id, k, n, index, transfer length
+#define FEC_MAX_N 64                        // Messages per transfer, data + parity
+#define FEC_SPOOL_DIR "/var/tmp/sbdctl.fec" // Received shards until k are in
+#define FEC_SPOOL_AGE 86400                 // Partial transfers older than this are dropped
+#define FEC_BENCH_K 10                      // -B transfer shape
+#define FEC_BENCH_N 15
+
+// Command Agent
+#define AGENT_CONFIG "/etc/sbdctl.agent"    // <opcode> <handler command> per line
+#define AGENT_QUEUE_FILE "/var/tmp/sbdctl.replies" // Replies waiting for a session
+#define AGENT_CMD_MAGIC "AC"                // MT command message
+#define AGENT_REPLY_MAGIC "AR"              // MO reply message
+#define AGENT_QUEUE_MAX 4096                // Reply bytes held, newer replies dropped past this
+#define AGENT_OUT_MAX 255                   // Handler output kept per reply
+#define AGENT_TIMEOUT_MS 30000              // Handler is killed after this
+#define AGENT_MAX_SESSIONS 8                // Sessions per -A pass
+#define AGENT_OP_PING 0                     // Built in, echoes its argument back
+#define AGENT_ST_UNKNOWN 254                // Reply status for an opcode with no handler
+struct agent_queue {
+	uint16_t len;                           // bytes of replies in buf
+	uint16_t loaded;                        // bytes of buf in the MO buffer, 0 if none
+	unsigned char buf[AGENT_QUEUE_MAX];
+};
+
+// Shared Status Board
+#define BOARD_NAME "/sbdctl.status"         // POSIX shm object, /dev/shm/sbdctl.status
+#define BOARD_MAGIC 0x53424453              // "SBDS"
+#define BOARD_VERSION 1
+#define BOARD_READ_TRIES 1000               // Give up on a writer that died mid-update
+// Whoever holds the port publishes what it learns here.  To read: wait for
+//  seq to be even, copy the struct, and if seq changed meanwhile do it again.
+//  Times are unix ms, 0 if that part was never written.
+struct sbd_board {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;                           // odd while being written
+	uint32_t pid;                           // last writer
+	int64_t updated_ms;
+	int64_t rssi_ms;
+	int64_t sbdsx_ms;
+	int64_t sbdix_ms;
+	int64_t agent_ms;
+	int32_t rssi;
+	int32_t sbdsx[SBDSX_FIELDS];
+	int32_t sbdix[SBDIX_FIELDS];
+	int32_t agent_pending;                  // -A reply bytes waiting for a session
+};
+
+// Multi-client Arbitration
+#define ARB_MAGIC "SBD1"                    // Request header
+#define ARB_MAX_CLIENTS 16                  // Clients queued at once
+#define ARB_MAX_JOBS 16                     // Options per client request
+#define ARB_MAX_WEIGHT 16
+#define ARB_REQ_MAX 1024                    // Request message size
+#define ARB_AGE_MS 60000                    // Queued session counts as quick after this
+#define ARB_STDIN_MS 10000                  // Client's stdin must deliver a payload within this
+#define ARB_JOB_OPTS "ctdTDrsiklmagXYA"     // Options a client may send
+#define ARB_QUICK 0
+#define ARB_SESSION 1
+
+// Options that act on the modem run with one of these, from the command
+//  line or on behalf of an arbitration client.
+struct sbd_opts {
+	int fd;                                 // serial port, -1 until first needed
+	char port[12];
+	int geo_maxage;                         // staleness bound for -g, seconds
+	double min_p;                           // -W, sessions held back below this, 0 for off
+};
+
 // Function Prototypes
 
+// Output Records
+int out_open(char* spec);
+int out_set_format(char* name);
+void rec_begin(const char* op);
+void rec_int(const char* key, long long value);
+void rec_str(const char* key, const char* value);
+void rec_text(const char* key, const char* value);
+void rec_float(const char* key, double value, int prec);
+void rec_bytes(const char* key, const unsigned char* buf, int len);
+void rec_fault(const char* fault);
+void rec_recovery(const char* step);
+void rec_end(int err);
+
 // Setup
 int serial_init(int fd);
 int set_serial_mode(int fd, int option);
@@ -53,16 +236,34 @@ int check_binary(char* buf, int buf_len);
 
 // Communication
 int write_to_imu(const char* buf, int size, int fd);
+int read_raw_imu(int fd, unsigned char* buf, int size);
 int read_binary_from_imu(unsigned char* buf, int fd);
 int read_from_imu(unsigned char* buf, int fd);
 int imu_rw(const char* command, char* buf, int fd);
 
+// Fault Recovery
+int imu_fault(int size, const char* buf);
+int imu_recover(int fd, int fault, int attempt);
+int reinit_port(int fd);
+
 // RSSI Handling
 int get_rssi(int fd);
-void getsbdrssi(int fd);
+int getsbdrssi(int fd);
 
 // Modem Information
-void info(int fd);
+int info(int fd);
+
+// Geolocation and System Time Cache
+int geo_load(struct geo_cache* geo);
+int geo_save(const struct geo_cache* geo);
+int geo_refresh(int fd, struct geo_cache* geo);
+void print_geo(const struct geo_cache* geo);
+int64_t iridium_to_unix_ms(uint32_t ticks);
+// Signal History and Pass Prediction
+void hist_add(int kind, int rssi, int status);
+double hist_predict(time_t when, int rssi);
+time_t hist_next_window(time_t now, double min_p, double* p);
+void print_prediction(double min_p);
 
 // Message Handling
 int send_text_message(char* themessage, int length, int fd);
@@ -70,11 +271,11 @@ int send_binary_data(char* buf, int fd, int len);
 int get_text_data(char* buf, int fd);
 int print_text_data(int fd);
 void print_binary_data(char* buf, int len);
-void dread(int fd);
+int dread(int fd);
 
 // Buffer Management
 int clearbufs(int instruction, int fd);
-void getsbdstatus(int fd);
+int getsbdstatus(int fd);
 int cpymomtbuf(int fd);
 
 // Session Management
@@ -83,6 +284,42 @@ int sbdopensession(int fd);
 // Sending Data
 int sending_text(int fd, int len);
 int sending_binary(int fd, int len);
+int fec_send(int fd, char* ratio);
+int fec_receive(int fd);
+// Command Agent
+int agent_run(int fd, struct sbd_opts* opts);
+
+// Trace Record/Replay
+int trace_record_open(char* filename);
+int trace_replay_open(char* filename);
+void trace_close(void);
+
+// Adaptive Read Timeouts
+int latency_load(void);
+int latency_save(void);
+int latency_deadline_ms(int cmd_class);
+
+// Payload Envelope (ChaCha20-Poly1305)
+int aead_load_key(char* filename);
+int envelope_seal(unsigned char* out, const unsigned char* in, int len, uint16_t momsn);
+int envelope_open(unsigned char* out, const unsigned char* in, int len);
+void bench(void);
+// Forward Error Correction
+int fec_encode(unsigned char** shard, int k, int n, int len);
+int fec_decode(unsigned char** shard, const int* have, int k, int n, int len);
+void fec_bench(void);
+
+// Shared Status Board
+void board_rssi(int rssi);
+void board_sbdsx(const int* f);
+void board_sbdix(const int* r);
+void board_agent(int pending);
+int board_read(struct sbd_board* out);
+int print_board(void);
+// Multi-client Arbitration
+int run_option(int c, char* arg, struct sbd_opts* opts);
+int arb_serve(char* path, struct sbd_opts* opts);
+int arb_request(char* path, int weight, char* jobs, int len);
 
 // Utility and Testing
 int test_function(int fd);